@@ -16,9 +16,8 @@
 
 #undef NDEBUG
 
-#include "ospray/common/OSPCommon.h"
-#include "apps/common/xml/XML.h"
 #include "ParticleModel.h"
+#include "TextParsing.h"
 
 #define SILENT
 
@@ -27,17 +26,28 @@ namespace ospray {
     using std::cout;
     using std::endl;
 
-    void importModel(ParticleModel *model, const ospcommon::FileName &fileName)
+    //! the records of one chunk of lines, up to the first bad one
+    struct Chunk {
+      Chunk() : complete(true) {}
+
+      std::vector<vec3f> position;
+      std::vector<float> value;
+      //! whether all of the chunk's lines parsed
+      bool complete;
+    };
+
+    /*! parse "l1 l2 l3 data" lines until the first one that doesn't */
+    static void parseChunk(const char *p, const char *end, Chunk &chunk)
     {
-      FILE *file = fopen(fileName.c_str(),"r");
-      if (!file) 
-        throw std::runtime_error("could not open input file "+fileName.str());
-      std::cout << "#" << fileName << " (COSMOS format)" << std::endl;
-      while (1) {
+      for (;p < end;p = text::nextLine(p,end)) {
+        if (text::atEndOfLine(p,end))
+          continue;
         float l1, l2, l3, data;
-        int rc = fscanf(file,"%f %f %f %f\n",&l1,&l2,&l3,&data);
-        if (rc != 4) break;
-        
+        if (!text::parseFloat(p,end,l1) || !text::parseFloat(p,end,l2) ||
+            !text::parseFloat(p,end,l3) || !text::parseFloat(p,end,data)) {
+          chunk.complete = false;
+          return;
+        }
         float value =  ((2.0*l1+1.0)*(2.0*l2+1.0)*(2.0*l3+1.0))*((l1+l2+l3)*(l1+l2+l3+3))/(2*(l1+l2+l3)+3)*data;
 
         value *= 1e12f;
@@ -48,11 +58,36 @@ namespace ospray {
         // a = std::max(a,min_val);
         // a = std::min(a,max_val);
 
-        model->position.push_back(vec3f(l1,l2,l3));
-        model->addAttribute("COSMOS",value);
+        chunk.position.push_back(vec3f(l1,l2,l3));
+        chunk.value.push_back(value);
+      }
+    }
+
+    void importModel(ParticleModel *model, const ospcommon::FileName &fileName)
+    {
+      const text::MappedFile file(fileName.str());
+      std::cout << "#" << fileName << " (COSMOS format)" << std::endl;
+      const std::vector<const char *> bounds = text::splitLines(file.begin,file.end);
+      std::vector<Chunk> chunks(bounds.size()-1);
+      tasking::parallel_for(chunks.size(),[&](size_t i){
+          parseChunk(bounds[i],bounds[i+1],chunks[i]);
+        });
+      // the records end at the first line that doesn't parse
+      size_t numChunks = 0;
+      while (numChunks < chunks.size() && chunks[numChunks++].complete);
+      chunks.resize(numChunks);
+
+      ParticleModel::Attribute *attr = model->getAttribute("COSMOS");
+      std::vector<std::vector<vec3f> > position(numChunks);
+      std::vector<std::vector<float> > value(numChunks);
+      for (size_t i=0;i<numChunks;i++) {
+        attr->extendRange(chunks[i].value.data(),chunks[i].value.size());
+        position[i].swap(chunks[i].position);
+        value[i].swap(chunks[i].value);
       }
+      text::appendChunks(model->position,position);
+      text::appendChunks(attr->value,value);
     }
 
   } // ::ospray::particle
 } // ::ospray
-
@@ -17,7 +17,6 @@
 #undef NDEBUG
 
 #include "ospray/common/OSPCommon.h"
-#include "apps/common/xml/XML.h"
 #include "ParticleModel.h"
 
 #define SILENT
@@ -80,16 +79,24 @@ namespace ospray {
       // printf( "num_writes: %d\n", num_writes );
 
       
+      // read (position,velocity) records a block at a time
+      ParticleModel::Attribute *speed = model->getAttribute("v");
+      if (np_local > 0)
+        model->reserve(np_local);
+      std::vector<vec3f> record(2*blocksize);
+      std::vector<vec3f> p(blocksize);
+      std::vector<float> v(blocksize);
       while (1) {
-        vec3f p,v;
-        int rc;
-        rc = fread(&p,sizeof(float),3,file);
-        if (rc == 0) break;
-        rc = fread(&v,sizeof(float),3,file);
-        if (rc == 0) break;
-        model->position.push_back(p);
-        model->addAttribute("v",sqrtf(dot(v,v)));
+        const size_t n = fread(&record[0],2*sizeof(vec3f),blocksize,file);
+        for (size_t i=0;i<n;i++) {
+          p[i] = record[2*i];
+          v[i] = sqrtf(dot(record[2*i+1],record[2*i+1]));
+        }
+        model->appendPositions(&p[0],n);
+        speed->append(&v[0],n);
+        if (n < size_t(blocksize)) break;
       }
+      fclose(file);
     }
 
   } // ::ospray::particle
@@ -70,8 +70,16 @@ namespace ospray {
 			model->lidar_current_bounds.extend(min_pt);
 			model->lidar_current_bounds.extend(max_pt);
 
+			ParticleModel::Attribute *color = model->getAttribute("color");
+			model->reserve(reader->npoints);
 			int num_noise = 0;
 			const float inv_max_color = 1.0f / std::numeric_limits<uint16_t>::max();
+			// points (and their colors) get appended a block at a time
+			const size_t block_size = 64 * 1024;
+			std::vector<vec3f> positions;
+			std::vector<float> colors;
+			positions.reserve(block_size);
+			colors.reserve(block_size);
 			while (reader->read_point()){
 				// Points classified as low point are noise and should be discarded
 				if (classify_point(reader->point.get_classification()) == NOISE){
@@ -94,9 +102,17 @@ namespace ospray {
 				SET_RED(col_masked, static_cast<int>(c.x * 255));
 				SET_GREEN(col_masked, static_cast<int>(c.y * 255));
 				SET_BLUE(col_masked, static_cast<int>(c.z * 255));
-				model->position.push_back(p);
-				model->addAttribute("color", *reinterpret_cast<float*>(&col_masked));
+				positions.push_back(p);
+				colors.push_back(*reinterpret_cast<float*>(&col_masked));
+				if (positions.size() == block_size){
+					model->appendPositions(positions.data(), positions.size());
+					color->append(colors.data(), colors.size());
+					positions.clear();
+					colors.clear();
+				}
 			}
+			model->appendPositions(positions.data(), positions.size());
+			color->append(colors.data(), colors.size());
 			std::cout << "Discarded " << num_noise << " noise classified points\n";
 			reader->close();
 			delete reader;
@@ -17,7 +17,7 @@
 #undef NDEBUG
 
 #include "ospray/common/OSPCommon.h"
-#include "apps/common/xml/XML.h"
+#include "ospcommon/xml/XML.h"
 #include "ParticleModel.h"
 
 #define SILENT
@@ -25,7 +25,9 @@
 namespace ospray {
   namespace uintah {
 
-    bool big_endian = false;
+    //! endianness of the timestep being read (per thread, as ospPartiKD
+    //! may load several timesteps at once)
+    thread_local bool big_endian = false;
 
     struct Particle {
       double x,y,z;
@@ -71,23 +73,23 @@ namespace ospray {
       }
       // PRINT(len);
       
-      for (int i=0;i<numParticles;i++) {
-        Particle p;
-        int rc = fread(&p,sizeof(p),1,file);
-        if (rc != 1) {
-          fclose(file);
-          throw std::runtime_error("read partial data "+fn);
-        }
+      std::vector<Particle> p(numParticles);
+      if (fread(p.data(),sizeof(Particle),numParticles,file) != numParticles) {
+        fclose(file);
+        throw std::runtime_error("read partial data "+fn);
+      }
+      std::vector<vec3f> position(numParticles);
+      for (size_t i=0;i<numParticles;i++) {
 #if 1
         if (big_endian) {
-          p.x = htonlf(p.x);
-          p.y = htonlf(p.y);
-          p.z = htonlf(p.z);
+          p[i].x = htonlf(p[i].x);
+          p[i].y = htonlf(p[i].y);
+          p[i].z = htonlf(p[i].z);
         }
 #endif
-        vec3f position = vec3f(p.x,p.y,p.z);
-        model->position.push_back(position);
+        position[i] = vec3f(p[i].x,p[i].y,p[i].z);
       }
+      model->appendPositions(position.data(),numParticles);
       
 #ifndef SILENT        
       std::cout << "\r#osp:uintah: read " << numParticles << " particles (total " << float((model->position.size())/1e6) << "M)";
@@ -118,18 +120,15 @@ namespace ospray {
       }
       // PRINT(len);
       
-      for (int i=0;i<numParticles;i++) {
-        double attrib;
-        int rc = fread(&attrib,sizeof(attrib),1,file);
-        if (rc != 1) {
-          fclose(file);
-          throw std::runtime_error("read partial data "+fn);
-        }
-        if (big_endian) {
-          attrib = htonlf(attrib);
-        }
-        model->addAttribute(attrName,attrib);
+      std::vector<double> attrib(numParticles);
+      if (fread(attrib.data(),sizeof(double),numParticles,file) != numParticles) {
+        fclose(file);
+        throw std::runtime_error("read partial data "+fn);
       }
+      std::vector<float> value(numParticles);
+      for (size_t i=0;i<numParticles;i++)
+        value[i] = big_endian ? htonlf(attrib[i]) : attrib[i];
+      model->getAttribute(attrName)->append(value.data(),numParticles);
       
       std::stringstream attrs;
       for (std::vector<ParticleModel::Attribute *>::const_iterator it=model->attribute.begin();
@@ -166,21 +165,18 @@ namespace ospray {
       }
       // PRINT(len);
       
-      for (int i=0;i<numParticles;i++) {
-        float attrib;
-        int rc = fread(&attrib,sizeof(attrib),1,file);
-        if (rc != 1) {
-          fclose(file);
-          throw std::runtime_error("read partial data "+fn);
-        }
+      std::vector<float> attrib(numParticles);
+      if (fread(attrib.data(),sizeof(float),numParticles,file) != numParticles) {
+        fclose(file);
+        throw std::runtime_error("read partial data "+fn);
+      }
 #if 1
-        if (big_endian) {
-          attrib = htonf(attrib);
-        }
-#endif
-
-        model->addAttribute(attrName,attrib);
+      if (big_endian) {
+        for (size_t i=0;i<numParticles;i++)
+          attrib[i] = htonf(attrib[i]);
       }
+#endif
+      model->getAttribute(attrName)->append(attrib.data(),numParticles);
       
       std::stringstream attrs;
       for (std::vector<ParticleModel::Attribute *>::const_iterator it=model->attribute.begin();
@@ -198,38 +194,30 @@ namespace ospray {
 
 
     void parse__Variable(ParticleModel *model,
-                         const std::string &basePath, xml::Node *var)
+                         const std::string &basePath, const ospcommon::xml::Node &var)
     {
-      size_t index = -1;
       size_t start = -1;
       size_t end = -1;
-      size_t patch = -1;
       size_t numParticles = 0;
       std::string variable;
       std::string filename;
-      std::string varType = var->getProp("type");
-      for (int i=0;i<var->child.size();i++) {
-        xml::Node *n = var->child[i];
-        if (n->name == "index") {
-          index = atoi(n->content.c_str());
-        } else if (n->name == "variable") {
-          variable = n->content;
-        } else if (n->name == "numParticles") {
-          numParticles = atol(n->content.c_str());
-        } else if (n->name == "patch") {
-          patch = atol(n->content.c_str());
-        } else if (n->name == "filename") {
-          filename = n->content;
-        } else if (n->name == "start") {
-          start = atol(n->content.c_str());
-        } else if (n->name == "end") {
-          end = atol(n->content.c_str());
+      std::string varType = var.getProp("type");
+      for (const ospcommon::xml::Node &n : var.child) {
+        if (n.name == "variable") {
+          variable = n.content;
+        } else if (n.name == "numParticles") {
+          numParticles = atol(n.content.c_str());
+        } else if (n.name == "filename") {
+          filename = n.content;
+        } else if (n.name == "start") {
+          start = atol(n.content.c_str());
+        } else if (n.name == "end") {
+          end = atol(n.content.c_str());
         }
       }
 
       if (numParticles > 0
           && variable == "p.x"
-          /* && index == .... */ 
           ) {
         readParticles(model,numParticles,basePath+"/"+filename,start,end);
       }
@@ -250,10 +238,10 @@ namespace ospray {
     {
       std::string basePath = ospcommon::FileName(fileName).path();
 
-      xml::XMLDoc *doc = NULL;
+      std::shared_ptr<ospcommon::xml::XMLDoc> doc;
       try {
-        doc = xml::readXML(fileName);
-      } catch (std::runtime_error e) {
+        doc = ospcommon::xml::readXML(fileName);
+      } catch (const std::runtime_error &e) {
         model->cullPartialData();
         static bool warned = false;
         if (!warned) {
@@ -266,48 +254,41 @@ namespace ospray {
       }
       assert(doc);
       assert(doc->child.size() == 1);
-      xml::Node *node = doc->child[0];
-      assert(node->name == "Uintah_Output");
-      for (int i=0;i<node->child.size();i++) {
-        xml::Node *c = node->child[i];
-        assert(c->name == "Variable");
+      const ospcommon::xml::Node &node = doc->child[0];
+      assert(node.name == "Uintah_Output");
+      for (const ospcommon::xml::Node &c : node.child) {
+        assert(c.name == "Variable");
         parse__Variable(model,basePath,c);
       }
-      delete doc;
     }
     void parse__Uintah_TimeStep_Data(ParticleModel *model,
-                                     const std::string &basePath, xml::Node *node)
+                                     const std::string &basePath, const ospcommon::xml::Node &node)
     {
-      assert(node->name == "Data");
-      for (int i=0;i<node->child.size();i++) {
-        xml::Node *c = node->child[i];
-        assert(c->name == "Datafile");
-        for (int j=0;j<c->prop.size();j++) {
-          xml::Prop *p = c->prop[j];
-          if (p->name == "href") {
-            try {
-              parse__Uintah_Datafile(model,basePath+"/"+p->value);
-            } catch (std::runtime_error e) {
-              static bool warned = false;
-              if (!warned) {
-                std::cerr << "#osp:uintah: error in parsing timestep data: " << e.what() << std::endl;
-                std::cerr << "#osp:uintah: continuing parsing, but parts of the data will be missing" << std::endl;
-                std::cerr << "#osp:uintah: (only printing first instance of this error; there may be more)" << std::endl;
-                warned = true;
-              }
-            }
+      assert(node.name == "Data");
+      for (const ospcommon::xml::Node &c : node.child) {
+        assert(c.name == "Datafile");
+        const std::string href = c.getProp("href");
+        if (href.empty())
+          continue;
+        try {
+          parse__Uintah_Datafile(model,basePath+"/"+href);
+        } catch (const std::runtime_error &e) {
+          static bool warned = false;
+          if (!warned) {
+            std::cerr << "#osp:uintah: error in parsing timestep data: " << e.what() << std::endl;
+            std::cerr << "#osp:uintah: continuing parsing, but parts of the data will be missing" << std::endl;
+            std::cerr << "#osp:uintah: (only printing first instance of this error; there may be more)" << std::endl;
+            warned = true;
           }
         }
       }
     }
-    void parse__Uintah_TimeStep_Meta(ParticleModel *model,
-                                     const std::string &basePath, xml::Node *node)
+    void parse__Uintah_TimeStep_Meta(const ospcommon::xml::Node &node)
     {
-      assert(node->name == "Meta");
-      for (int i=0;i<node->child.size();i++) {
-        xml::Node *c = node->child[i];
-        if (c->name == "endianness") {
-          if (c->content == "big_endian") {
+      assert(node.name == "Meta");
+      for (const ospcommon::xml::Node &c : node.child) {
+        if (c.name == "endianness") {
+          if (c.content == "big_endian") {
             std::cout << "#osp:uintah: SWITCHING TO BIG_ENDIANNESS" << std::endl;
             big_endian = true;
           }
@@ -315,15 +296,14 @@ namespace ospray {
       }
     }
     void parse__Uintah_timestep(ParticleModel *model,
-                                const std::string &basePath, xml::Node *node)
+                                const std::string &basePath, const ospcommon::xml::Node &node)
     {
-      assert(node->name == "Uintah_timestep");
-      for (int i=0;i<node->child.size();i++) {
-        xml::Node *c = node->child[i];
-        if (c->name == "Meta") {
-          parse__Uintah_TimeStep_Meta(model,basePath,c);
+      assert(node.name == "Uintah_timestep");
+      for (const ospcommon::xml::Node &c : node.child) {
+        if (c.name == "Meta") {
+          parse__Uintah_TimeStep_Meta(c);
         }
-        if (c->name == "Data") {
+        if (c.name == "Data") {
           parse__Uintah_TimeStep_Data(model,basePath,c);
         }
       }
@@ -331,11 +311,11 @@ namespace ospray {
     
     void importModel(ParticleModel *model, const ospcommon::FileName &s)
     {
-      xml::XMLDoc *doc = xml::readXML(s);
+      std::shared_ptr<ospcommon::xml::XMLDoc> doc = ospcommon::xml::readXML(s);
+      big_endian = false;
 
-      assert(doc);
-      assert(doc->child.size() == 1);
-      assert(doc->child[0]->name == "Uintah_timestep");
+      if (!doc || doc->child.size() != 1 || doc->child[0].name != "Uintah_timestep")
+        throw std::runtime_error("#osp:pkd: '"+s.str()+"' is not a uintah timestep");
       std::string basePath = ospcommon::FileName(s).path();
       parse__Uintah_timestep(model, basePath, doc->child[0]);
 
@@ -349,12 +329,11 @@ namespace ospray {
                 << model->position.size() << " particles (" << attrs.str() << ")" << std::endl;
 
       box3f bounds = ospcommon::empty;
-      for (int i=0;i<model->position.size();i++) {
+      for (size_t i=0;i<model->position.size();i++) {
         bounds.extend(model->position[i]);
       }
       std::cout << "#osp:mpm: bounds of particle centers: " << bounds << std::endl;
       model->radius = .002f;
-      delete doc;
     }
 
   } // ::ospray::particle
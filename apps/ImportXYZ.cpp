@@ -16,8 +16,8 @@
 
 #undef NDEBUG
 
-#include "ospcommon/xml/XML.h"
 #include "ParticleModel.h"
+#include "TextParsing.h"
 
 #define SILENT
 
@@ -26,94 +26,146 @@ namespace ospray {
     using std::cout;
     using std::endl;
 
-    void importModelNoHeader(ParticleModel *model, const ospcommon::FileName &fileName)
+    /*! the atoms of one chunk of lines, with atom types numbered in
+        order of their first appearance in the chunk */
+    struct Chunk {
+      Chunk() : lastType(-1), numLines(0), badLine(-1) {}
+
+      //! local ID of the given atom name (usually the last one's)
+      int typeIDOf(const char *name, const size_t length)
+      {
+        if (lastType >= 0 && typeName[lastType].size() == length
+            && memcmp(typeName[lastType].data(),name,length) == 0)
+          return lastType;
+        for (lastType=0;lastType<int(typeName.size());lastType++)
+          if (typeName[lastType].size() == length
+              && memcmp(typeName[lastType].data(),name,length) == 0)
+            return lastType;
+        typeName.push_back(std::string(name,length));
+        return lastType;
+      }
+
+      std::vector<vec3f> position;
+      std::vector<int>   type;
+      std::vector<std::string> typeName;
+      int lastType;
+      //! number of (non-blank) lines, and the first unparseable one
+      long numLines, badLine;
+    };
+
+    /*! parse "<atomName> x y z [nx ny nz]" lines (the normal, if any,
+        gets ignored) until the first one that doesn't parse */
+    static void parseChunk(const char *p, const char *end, Chunk &chunk)
     {
-      int rc;
-      FILE *file = fopen(fileName.c_str(),"r");
-      if (!file) 
-        throw std::runtime_error("could not open input file "+fileName.str());
+      for (;p < end;p = text::nextLine(p,end)) {
+        if (text::atEndOfLine(p,end))
+          continue;
+        const char *name;
+        size_t length;
+        vec3f pos, n;
+        bool ok = text::parseToken(p,end,name,length) && length <= 100
+          && text::parseFloat(p,end,pos.x)
+          && text::parseFloat(p,end,pos.y)
+          && text::parseFloat(p,end,pos.z);
+        if (ok && !text::atEndOfLine(p,end))
+          // either a full normal, or something that isn't a number
+          ok = !text::parseFloat(p,end,n.x)
+            || (text::parseFloat(p,end,n.y) && text::parseFloat(p,end,n.z));
+        if (!ok) {
+          chunk.badLine = chunk.numLines;
+          return;
+        }
+        chunk.position.push_back(pos);
+        chunk.type.push_back(chunk.typeIDOf(name,length));
+        ++chunk.numLines;
+      }
+    }
 
-      char line[10000]; 
-      fgets(line,10000,file); // description line
+    /*! parse all atom lines in [begin,end), in parallel chunks, and
+        add them to the model; with 'numAtoms' >= 0, exactly that many
+        (and whatever follows them, e.g., more time steps, is ignored) */
+    static void importAtoms(ParticleModel *model, const ospcommon::FileName &fileName,
+                            const char *begin, const char *end, const long numAtoms)
+    {
+      const long maxAtoms = numAtoms < 0 ? std::numeric_limits<long>::max() : numAtoms;
+      const std::vector<const char *> bounds = text::splitLines(begin,end);
+      std::vector<Chunk> chunks(bounds.size()-1);
+      tasking::parallel_for(chunks.size(),[&](size_t i){
+          parseChunk(bounds[i],bounds[i+1],chunks[i]);
+        });
 
-      int i = 0;
-      while (fgets(line,10000,file) && !feof(file)) {
-        ++i;
-        char atomName[110];
-        vec3f p;
-        vec3f n;
-        rc = sscanf(line,"%100s %f %f %f %f %f %f\n",atomName,
-                    &p.x,&p.y,&p.z,
-                    &n.x,&n.y,&n.z
-                    );
-        if (rc != 7 && rc != 4) {
+      long numParsed = 0;
+      size_t numChunks = 0;
+      for (;numChunks<chunks.size() && numParsed<maxAtoms;numChunks++) {
+        const Chunk &c = chunks[numChunks];
+        if (c.badLine >= 0 && numParsed+c.badLine < maxAtoms) {
           std::stringstream ss;
-          ss << "in " << fileName << " (line " << (i+2) << "): "
+          ss << "in " << fileName << " (atom " << (numParsed+c.badLine+1) << "): "
              << "could not parse .dat.xyz data line" << std::endl;
           throw std::runtime_error(ss.str());
         }
-        int32 type = model->getAtomTypeID(atomName);
-        model->type.push_back(type);
-        model->position.push_back(p);
+        numParsed += c.numLines;
+      }
+      if (numAtoms >= 0 && numParsed < numAtoms) {
+        std::stringstream ss;
+        ss << "in " << fileName << " (atom " << (numParsed+1) << "): "
+           << "unexpected end of file!?" << std::endl;
+        throw std::runtime_error(ss.str());
+      }
+      chunks.resize(numChunks);
+      if (numParsed > maxAtoms) {
+        // drop what's past the last atom
+        Chunk &last = chunks.back();
+        last.position.resize(last.position.size()-(numParsed-maxAtoms));
+        last.type.resize(last.type.size()-(numParsed-maxAtoms));
+        // and its atom types that only those had
+        int numTypes = 0;
+        for (size_t j=0;j<last.type.size();j++)
+          numTypes = std::max(numTypes,last.type[j]+1);
+        last.typeName.resize(numTypes);
       }
-    }
 
+      // merge the chunks' atom types, in chunk order, so they get the
+      // same IDs as when parsing the file front to back
+      std::vector<std::vector<int> > globalID(chunks.size());
+      for (size_t i=0;i<chunks.size();i++)
+        for (size_t t=0;t<chunks[i].typeName.size();t++)
+          globalID[i].push_back(model->getAtomTypeID(chunks[i].typeName[t]));
+      std::vector<std::vector<vec3f> > position(chunks.size());
+      std::vector<std::vector<int> > type(chunks.size());
+      tasking::parallel_for(chunks.size(),[&](size_t i){
+          for (size_t j=0;j<chunks[i].type.size();j++)
+            chunks[i].type[j] = globalID[i][chunks[i].type[j]];
+          position[i].swap(chunks[i].position);
+          type[i].swap(chunks[i].type);
+        });
+      text::appendChunks(model->position,position);
+      text::appendChunks(model->type,type);
+    }
 
     void importModel(ParticleModel *model, const ospcommon::FileName &fileName)
     {
-      FILE *file = fopen(fileName.c_str(),"r");
-      if (!file) 
-        throw std::runtime_error("could not open input file "+fileName.str());
-      int numAtoms;
+      const text::MappedFile file(fileName.str());
+      const char *p = file.begin, *end = file.end;
 
-      // int rc = sscanf(line,"%i",&numAtoms);
-      int rc = fscanf(file,"%i\n",&numAtoms);
-      PRINT(numAtoms);
-      if (rc != 1) {
+      // "<numAtoms>", a description line, and the atoms - or, without
+      // that header, a description line and atoms up to the end
+      long numAtoms = 0;
+      const char *q = p;
+      const bool hasHeader = text::parseInt(q,end,numAtoms) && numAtoms >= 0
+        && text::atEndOfLine(q,end);
+      p = text::nextLine(p,end); // description line, or count
+      if (hasHeader) {
+        PRINT(numAtoms);
+        p = text::nextLine(p,end);
+        std::cout << "#" << fileName << " (.dat.xyz format): expecting " << numAtoms << " atoms" << std::endl;
+        importAtoms(model,fileName,p,end,numAtoms);
+      } else {
         cout << "could not parse .dat.xyz header in input file " << fileName.str() << endl;
-        cout << "trying to parse without header..." << endl;
-        fclose(file);
-        importModelNoHeader(model,fileName);
-        return;
-      }
-      
-      char line[10000]; 
-      fgets(line,10000,file); // description line
-
-      std::cout << "#" << fileName << " (.dat.xyz format): expecting " << numAtoms << " atoms" << std::endl;
-      for (int i=0;i<numAtoms;i++) {
-        char atomName[110];
-        vec3f p;
-        vec3f n;
-        if (!fgets(line,10000,file)) {
-          std::stringstream ss;
-          ss << "in " << fileName << " (line " << (i+2) << "): "
-             << "unexpected end of file!?" << std::endl;
-          throw std::runtime_error(ss.str());
-        }
-
-        rc = sscanf(line,"%100s %f %f %f %f %f %f\n",atomName,
-                    &p.x,&p.y,&p.z,
-                    &n.x,&n.y,&n.z
-                    );
-        // rc = fscanf(file,"%100s %f %f %f %f %f %f\n",atomName,
-        //             &a.position.x,&a.position.y,&a.position.z,
-        //             &n.x,&n.y,&n.z
-        //             );
-        if (rc != 7 && rc != 4) {
-          std::stringstream ss;
-          PRINT(rc);
-          PRINT(line);
-          ss << "in " << fileName << " (line " << (i+2) << "): "
-             << "could not parse .dat.xyz data line" << std::endl;
-          throw std::runtime_error(ss.str());
-        }
-        int32 type = model->getAtomTypeID(atomName);
-        model->type.push_back(type);
-        model->position.push_back(p);
+        cout << "parsing without header..." << endl;
+        importAtoms(model,fileName,p,end,-1);
       }
     }
 
   } // ::ospray::particle
 } // ::ospray
-
@@ -14,16 +14,35 @@
 // limitations under the License.                                           //
 // ======================================================================== //
 
-#include <thread>
 #include "PartiKD.h"
+#include "PartiKDOutOfCore.h"
 #include "PKDConfig.h"
 #include "../ospray/MinMaxBVH2.h"
+#include "../ospray/PKDBounds.h"
+#include "../ospray/PKDContainer.h"
+#include "../ospray/PKDRangeTree.h"
 
 #include "ospcommon/constants.h"
 #include "ospcommon/FileName.h"
+#include "ospcommon/tasking/parallel_for.h"
+// std
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+// posix
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define CHECK 1
 
+/*! subtrees at least this big get partitioned in parallel */
+#define PARALLEL_PARTITION_THRESHOLD (1<<20)
+/*! subtrees at least this big spawn their two children as tasks */
+#define PARALLEL_BUILD_THRESHOLD (1<<12)
+/*! number of levels the select-builder builds (and times) breadth-first */
+#define SELECT_MAX_BFS_LEVELS 16
+
 //#define DIM_FROM_DEPTH 1
 //#define DIM_ROUND_ROBIN 1
 
@@ -36,9 +55,7 @@ namespace ospray {
 #if DIM_FROM_DEPTH
     return;
 #else
-    vec3f &particle = (vec3f &)this->model->position[ID];
-    int &pxAsInt = (int &)particle.x;
-    pxAsInt = (pxAsInt & ~3) | dim;
+    setDimBits(item[ID].pos.x,dim);
 #endif
   }
 
@@ -50,6 +67,16 @@ namespace ospray {
     __forceinline SubtreeIterator(size_t root)
       : curInLevel(0), maxInLevel(1), current(root) 
     {}
+    /*! iterator pointing to the rank'th node (in level order) of the
+        subtree rooted at 'root' */
+    __forceinline SubtreeIterator(size_t root, size_t rank)
+    {
+      size_t level = 0;
+      while ((size_t(2) << level) <= rank+1) ++level;
+      maxInLevel = size_t(1) << level;
+      curInLevel = rank+1 - maxInLevel;
+      current    = (root+1)*maxInLevel - 1 + curInLevel;
+    }
     __forceinline operator size_t() const { return current; }
     __forceinline void operator++() {
       ++current;
@@ -68,28 +95,227 @@ namespace ospray {
     }
   };
 
-  struct PKDBuildJob {
+  /*! \brief parallel median partition for one (large) node of the pkd
+
+      The serial partition loop in buildRec sweeps the entire subtree
+      once per root swap, on a single core. For the top-most nodes of
+      large models we instead (a) determine the key of the element that
+      has to end up in the root with a parallel radix-select, and (b)
+      exchange the misplaced elements between left and right subtree in
+      parallel. Both subtrees are addressed through their level-order
+      'rank' space (see SubtreeIterator), which we cut into blocks that
+      are handed out to the tasking system. */
+  struct ParallelPartition {
+    enum { BLOCK_SIZE = 64*1024 };
+
+    //! a subtree, addressed through its level-order rank
+    struct Region {
+      size_t root, size;
+    };
+
+    ParallelPartition(const PartiKD *pkd, const size_t nodeID, const size_t dim)
+      : pkd(pkd), nodeID(nodeID), dim(dim)
+    {
+      L.root = PartiKD::leftChildOf(nodeID);
+      R.root = PartiKD::rightChildOf(nodeID);
+      L.size = PartiKD::subtreeSizeOf(L.root,pkd->numParticles);
+      R.size = PartiKD::subtreeSizeOf(R.root,pkd->numParticles);
+    }
+
+    __forceinline uint32 keyOf(const size_t ID) const
+    { return orderedKeyOf(pkd->pos(ID,dim)); }
+
+    static size_t numBlocksOf(const Region &region)
+    { return (region.size+BLOCK_SIZE-1)/BLOCK_SIZE; }
+
+    /*! turn per-block counts into per-block offsets; return total */
+    static size_t prefixSum(std::vector<size_t> &count)
+    {
+      size_t sum = 0;
+      for (size_t i=0;i<count.size();i++) {
+        const size_t c = count[i];
+        count[i] = sum;
+        sum += c;
+      }
+      return sum;
+    }
+
+    /*! call 'f(nodeID)' for all nodes with rank [begin,end) in region */
+    template<typename Lambda>
+    static void forEachInRange(const Region &region, size_t begin, size_t end, 
+                               const Lambda &f)
+    {
+      SubtreeIterator it(region.root,begin);
+      for (size_t rank=begin;rank<end;rank++,++it)
+        f((size_t)it);
+    }
+
+    /*! count elements matching 'pred' in each block of 'region' */
+    template<typename Pred>
+    std::vector<size_t> countPerBlock(const Region &region, const Pred &pred) const
+    {
+      const size_t numBlocks = numBlocksOf(region);
+      std::vector<size_t> count(numBlocks);
+      tasking::parallel_for(numBlocks,[&](size_t blockID){
+          const size_t begin = blockID*BLOCK_SIZE;
+          const size_t end   = std::min(begin+BLOCK_SIZE,region.size);
+          size_t num = 0;
+          forEachInRange(region,begin,end,[&](size_t ID){ num += pred(keyOf(ID)); });
+          count[blockID] = num;
+        });
+      return count;
+    }
+
+    /*! find the iterator pointing to the 'skip'th element (counting
+        from 0) that matches 'pred', given per-block match counts */
+    template<typename Pred>
+    SubtreeIterator findMatch(const Region &region, 
+                              const std::vector<size_t> &blockOffset,
+                              size_t skip, const Pred &pred) const
+    {
+      const size_t blockID 
+        = std::upper_bound(blockOffset.begin(),blockOffset.end(),skip)
+        - blockOffset.begin() - 1;
+      skip -= blockOffset[blockID];
+      SubtreeIterator it(region.root,blockID*BLOCK_SIZE);
+      while (1) {
+        if (pred(keyOf(it))) {
+          if (skip == 0) return it;
+          --skip;
+        }
+        ++it;
+      }
+    }
+
+    /*! swap the i'th element in X that matches predX with the i'th
+        element of Y that matches predY, for as many pairs as there are */
+    template<typename PredX, typename PredY>
+    void swapMatches(const Region &X, const PredX &predX,
+                     const Region &Y, const PredY &predY) const
+    {
+      std::vector<size_t> xOffset = countPerBlock(X,predX);
+      std::vector<size_t> yOffset = countPerBlock(Y,predY);
+      const size_t numPairs = std::min(prefixSum(xOffset),prefixSum(yOffset));
+      if (numPairs == 0) return;
+
+      // find all start positions *before* anybody starts swapping
+      const size_t numTasks = (numPairs+BLOCK_SIZE-1)/BLOCK_SIZE;
+      std::vector<SubtreeIterator> xBegin(numTasks,SubtreeIterator(X.root));
+      std::vector<SubtreeIterator> yBegin(numTasks,SubtreeIterator(Y.root));
+      tasking::parallel_for(numTasks,[&](size_t taskID){
+          xBegin[taskID] = findMatch(X,xOffset,taskID*BLOCK_SIZE,predX);
+          yBegin[taskID] = findMatch(Y,yOffset,taskID*BLOCK_SIZE,predY);
+        });
+      tasking::parallel_for(numTasks,[&](size_t taskID){
+          const size_t numInTask = std::min(numPairs-taskID*BLOCK_SIZE,size_t(BLOCK_SIZE));
+          SubtreeIterator x = xBegin[taskID];
+          SubtreeIterator y = yBegin[taskID];
+          for (size_t i=0;i<numInTask;i++) {
+            while (!predX(keyOf(x))) ++x;
+            while (!predY(keyOf(y))) ++y;
+            pkd->swap(x,y);
+            ++x; ++y;
+          }
+        });
+    }
+
+    /*! parallel radix select of the key with given rank among all
+        elements in root, left, and right subtree */
+    uint32 selectKey(size_t rank) const
+    {
+      uint32 prefix = 0;
+      for (int shift=24;shift>=0;shift-=8) {
+        const uint32 prefixMask = (shift == 24) ? 0 : (0xffffffffu << (shift+8));
+        const size_t numBlocksL = numBlocksOf(L);
+        const size_t numBlocks  = numBlocksL+numBlocksOf(R);
+        std::vector<size_t> histogram(numBlocks*256,0);
+        tasking::parallel_for(numBlocks,[&](size_t blockID){
+            const Region &region = blockID < numBlocksL ? L : R;
+            const size_t begin 
+              = (blockID < numBlocksL ? blockID : blockID-numBlocksL)*BLOCK_SIZE;
+            const size_t end = std::min(begin+BLOCK_SIZE,region.size);
+            size_t *hist = &histogram[blockID*256];
+            forEachInRange(region,begin,end,[&](size_t ID){
+                const uint32 key = keyOf(ID);
+                if ((key & prefixMask) == prefix) hist[(key >> shift) & 255]++;
+              });
+          });
+        size_t total[256];
+        for (int b=0;b<256;b++) {
+          total[b] = 0;
+          for (size_t blockID=0;blockID<numBlocks;blockID++)
+            total[b] += histogram[blockID*256+b];
+        }
+        const uint32 rootKey = keyOf(nodeID);
+        if ((rootKey & prefixMask) == prefix) total[(rootKey >> shift) & 255]++;
+
+        int bin = 0;
+        while (rank >= total[bin]) { rank -= total[bin]; ++bin; }
+        prefix |= uint32(bin) << shift;
+      }
+      return prefix;
+    }
+
+    /*! check that the partition actually is a valid one */
+    bool isValid() const
+    {
+      const uint32 rootKey = keyOf(nodeID);
+      const size_t numBlocksL = numBlocksOf(L);
+      const size_t numBlocks  = numBlocksL+numBlocksOf(R);
+      std::vector<int> valid(numBlocks);
+      tasking::parallel_for(numBlocks,[&](size_t blockID){
+          const bool isLeft = blockID < numBlocksL;
+          const Region &region = isLeft ? L : R;
+          const size_t begin = (isLeft ? blockID : blockID-numBlocksL)*BLOCK_SIZE;
+          const size_t end   = std::min(begin+BLOCK_SIZE,region.size);
+          bool ok = true;
+          forEachInRange(region,begin,end,[&](size_t ID){
+              ok &= isLeft ? (keyOf(ID) <= rootKey) : (keyOf(ID) >= rootKey);
+            });
+          valid[blockID] = ok;
+        });
+      return std::find(valid.begin(),valid.end(),0) == valid.end();
+    }
+
+    void run()
+    {
+      // the root has to become the element with rank 'L.size' ...
+      const uint32 medianKey = selectKey(L.size);
+
+      // ... so find one such element, and move it into the root
+      if (keyOf(nodeID) != medianKey) {
+        const auto isMedian = [&](uint32 key) { return key == medianKey; };
+        const Region *region = &L;
+        std::vector<size_t> offset = countPerBlock(L,isMedian);
+        if (prefixSum(offset) == 0) {
+          region = &R;
+          offset = countPerBlock(R,isMedian);
+          prefixSum(offset);
+        }
+        pkd->swap(nodeID,findMatch(*region,offset,0,isMedian));
+      }
+
+      const auto isSmaller = [&](uint32 key) { return key <  medianKey; };
+      const auto isEqual   = [&](uint32 key) { return key == medianKey; };
+      const auto isLarger  = [&](uint32 key) { return key >  medianKey; };
+      // exchange misplaced elements between the two sides ...
+      swapMatches(L,isLarger,R,isSmaller);
+      // ... and, if one side had more of those than the other, swap
+      // the remaining ones with elements equal to the median
+      swapMatches(L,isLarger,R,isEqual);
+      swapMatches(R,isSmaller,L,isEqual);
+    }
+
     const PartiKD *const pkd;
     const size_t nodeID;
-    const box3f  bounds;
-    const size_t depth;
-    __forceinline PKDBuildJob(const PartiKD *pkd, size_t nodeID, box3f bounds, size_t depth) 
-      : pkd(pkd), nodeID(nodeID), bounds(bounds), depth(depth) 
-    {};
+    const size_t dim;
+    Region L, R;
   };
 
-  void *pkdBuildThread(void *arg)
-  {
-    PKDBuildJob *job = (PKDBuildJob *)arg;
-    job->pkd->buildRec(job->nodeID,job->bounds,job->depth);
-    delete job;
-    return NULL;
-  } 
-
   //#define FAST 1
 
 #if FAST
-#  define POS(idx,dim) position[idx].x
+#  define POS(idx,dim) position[idx].pos.x
 #else
 #  define POS(idx,dim) pos(idx,dim)
 #endif
@@ -114,7 +340,7 @@ namespace ospray {
 #endif
     const size_t N = numParticles;
 #if FAST
-    ParticleModel::vec_t *const position = (ParticleModel::vec_t*)(&model->position[0].x+dim);
+    PKDItem *const position = (PKDItem*)(&item[0].pos.x+dim);
 #endif
     if (!hasRightChild(nodeID)) {
       // no right child, but not a leaf emtpy. must have exactly one
@@ -128,7 +354,15 @@ namespace ospray {
       return;
     }
  
-    {
+    const size_t subtreeSize = PartiKD::subtreeSizeOf(nodeID,N);
+    if (subtreeSize >= PARALLEL_PARTITION_THRESHOLD) {
+      ParallelPartition partition(this,nodeID,dim);
+      partition.run();
+#if CHECK
+      if (!partition.isValid())
+        throw std::runtime_error("error in building. not a valid kd-tree...");
+#endif
+    } else {
 #if 1
     // we have a left and a right subtree, each of at least 1 node.
     SubtreeIterator l0(leftChildOf(nodeID));
@@ -299,16 +533,16 @@ namespace ospray {
       
     lBounds.upper[dim] = rBounds.lower[dim] = pos(nodeID,dim);
 
-#if 1
-    if ((numLevels - depth) > 20) {
-      std::thread lThread([&](){
-        pkdBuildThread(new PKDBuildJob(this,leftChildOf(nodeID),lBounds,depth+1));
-      });
-      buildRec(rightChildOf(nodeID),rBounds,depth+1);
-      lThread.join();
-    } else
-#endif
-      {
+    if (subtreeSize >= PARALLEL_BUILD_THRESHOLD) {
+      // let the tasking system's work-stealing scheduler balance the
+      // two subtrees (and everything spawned below them)
+      tasking::parallel_for(2,[&](int side){
+          if (side == 0)
+            buildRec(leftChildOf(nodeID),lBounds,depth+1);
+          else
+            buildRec(rightChildOf(nodeID),rBounds,depth+1);
+        });
+    } else {
         buildRec(leftChildOf(nodeID),lBounds,depth+1);
         buildRec(rightChildOf(nodeID),rBounds,depth+1);
       }
@@ -316,11 +550,39 @@ namespace ospray {
 
   inline void PartiKD::swap(const size_t a, const size_t b) const 
   { 
-    std::swap(model->position[a],model->position[b]);
+    std::swap(item[a],item[b]);
+  }
+
+  /*! out[i] = in[item[i].index], in parallel */
+  template<typename T>
+  void gather(std::vector<T> &array, const PKDItem *item, const size_t N)
+  {
+    enum { BLOCK_SIZE = 64*1024 };
+    std::vector<T> ordered(N);
+    tasking::parallel_for((N+BLOCK_SIZE-1)/BLOCK_SIZE,[&](size_t blockID){
+        const size_t begin = blockID*BLOCK_SIZE;
+        const size_t end   = std::min(begin+BLOCK_SIZE,N);
+        for (size_t i=begin;i<end;i++)
+          ordered[i] = array[item[i].index];
+      });
+    array.swap(ordered);
+  }
+
+  void PartiKD::reorderModel()
+  {
+    const double t0 = getSysTime();
+    tasking::parallel_for(numParticles,[&](size_t i){
+        model->position[i] = item[i].pos;
+      });
     for (size_t i=0;i<model->attribute.size();i++)
-      std::swap(model->attribute[i]->value[a],model->attribute[i]->value[b]);
+      gather(model->attribute[i]->value,item,numParticles);
     if (!model->type.empty())
-      std::swap(model->type[a],model->type[b]);
+      gather(model->type,item,numParticles);
+    if (!model->particleRadius.empty())
+      gather(model->particleRadius,item,numParticles);
+    const double t1 = getSysTime();
+    printf("#osp:pkd: re-ordered model (%li attributes): %.3f sec\n",
+           model->attribute.size(),t1-t0);
   }
 
   void PartiKD::build(ParticleModel *model) 
@@ -333,7 +595,6 @@ namespace ospray {
 
     assert(!model->position.empty());
     numParticles = model->position.size();
-    assert(numParticles <= (1ULL << 31));
 
 #if 0
     cout << "#osp:pkd: TEST: RANDOMIZING PARTICLES" << endl;
@@ -344,18 +605,279 @@ namespace ospray {
     cout << "#osp:pkd: RANDOMIZED" << endl;
 #endif
 
+    const box3f &bounds = model->getBounds();
+    std::cout << "#osp:pkd: bounds of model " << bounds << std::endl;
+    std::cout << "#osp:pkd: number of input particles " << numParticles << std::endl;
+
+    std::vector<PKDItem> items(numParticles);
+    tasking::parallel_for(numParticles,[&](size_t i){
+        items[i].pos   = model->position[i];
+        items[i].index = i;
+      });
+    if (numTreelets > 1) {
+      buildTreelets(&items[0],numParticles);
+    } else {
+      build(&items[0],numParticles,bounds);
+      treeletBegin.clear();
+      treeletBegin.push_back(0);
+      treeletBegin.push_back(numParticles);
+      treeletBounds.assign(1,bounds);
+    }
+    if (blockLevels > 0)
+      applyLayout(&items[0]);
+    reorderModel();
+    item = NULL;
+  }
+
+  void PartiKD::applyLayout(PKDItem *item) const
+  {
+    const double t0 = getSysTime();
+    tasking::parallel_for(treeletBounds.size(),[&](size_t treeletID){
+        const size_t begin = treeletBegin[treeletID];
+        const size_t size  = treeletBegin[treeletID+1]-begin;
+        const pkd::BlockedLayout layout(size,blockLevels);
+        std::vector<PKDItem> levelOrder(item+begin,item+begin+size);
+        for (size_t i=0;i<size;i++)
+          item[begin+layout.storageIndexOf(i)] = levelOrder[i];
+      });
+    const double t1 = getSysTime();
+    printf("#osp:pkd: applied blocked layout (%i levels per block): %.3f sec\n",
+           blockLevels,t1-t0);
+  }
+
+  void PartiKD::saveLayout(FILE *xml, const int blockLevels)
+  {
+    if (blockLevels > 0)
+      fprintf(xml,"<layout type=\"blocked\" blockLevels=\"%i\"/>\n",blockLevels);
+  }
+
+  /*! bounds of the positions of item[begin..end) */
+  inline box3f boundsOf(const PKDItem *item, const size_t begin, const size_t end)
+  {
+    box3f bounds = empty;
+    for (size_t i=begin;i<end;i++)
+      bounds.extend(item[i].pos);
+    return bounds;
+  }
+
+  /*! split item[begin..end) into the treelets
+      [firstTreelet..firstTreelet+numTreelets), by recursively
+      splitting at the (weighted) median of the widest dimension */
+  void PartiKD::splitTreelets(PKDItem *item, const size_t begin, const size_t end,
+                              const size_t firstTreelet, const size_t numTreelets)
+  {
+    if (numTreelets == 1) {
+      treeletBegin[firstTreelet] = begin;
+      return;
+    }
+
+    const box3f bounds = boundsOf(item,begin,end);
+    const int dim = maxDim(bounds.size());
+    const size_t numLeftTreelets = numTreelets/2;
+    const size_t mid = begin + (end-begin)*numLeftTreelets/numTreelets;
+    std::nth_element(item+begin,item+mid,item+end,
+                     [&](const PKDItem &a, const PKDItem &b){ return a.pos[dim] < b.pos[dim]; });
+
+    if (end-begin >= PARALLEL_BUILD_THRESHOLD) {
+      tasking::parallel_for(2,[&](int side){
+          if (side == 0)
+            splitTreelets(item,begin,mid,firstTreelet,numLeftTreelets);
+          else
+            splitTreelets(item,mid,end,firstTreelet+numLeftTreelets,numTreelets-numLeftTreelets);
+        });
+    } else {
+      splitTreelets(item,begin,mid,firstTreelet,numLeftTreelets);
+      splitTreelets(item,mid,end,firstTreelet+numLeftTreelets,numTreelets-numLeftTreelets);
+    }
+  }
+
+  void PartiKD::buildTreelets(PKDItem *item, const size_t numItems)
+  {
+    if (numTreelets > numItems)
+      throw std::runtime_error("PartiKD: more treelets than particles");
+    const double t0 = getSysTime();
+    treeletBegin.resize(numTreelets+1);
+    treeletBounds.resize(numTreelets);
+    splitTreelets(item,0,numItems,0,numTreelets);
+    treeletBegin[numTreelets] = numItems;
+    const double t1 = getSysTime();
+    printf("#osp:pkd: split into %li treelets: %.3f sec\n",numTreelets,t1-t0);
+
+    tasking::parallel_for(numTreelets,[&](size_t treeletID){
+        const size_t begin = treeletBegin[treeletID];
+        const size_t end   = treeletBegin[treeletID+1];
+        treeletBounds[treeletID] = boundsOf(item,begin,end);
+
+        PartiKD treelet(roundRobin,builder);
+        treelet.verbose = false;
+        treelet.build(item+begin,end-begin,treeletBounds[treeletID]);
+      });
+    const double t2 = getSysTime();
+    printf("#osp:pkd: built %li treelets: %.3f sec\n",numTreelets,t2-t1);
+
+    this->item    = item;
+    numParticles  = numItems;
+    numInnerNodes = 0;
+  }
+
+  void PartiKD::build(PKDItem *item, const size_t numItems, const box3f &bounds)
+  {
+    this->item    = item;
+    numParticles  = numItems;
     numInnerNodes = numInnerNodesOf(numParticles);
 
     // determine num levels
     numLevels = 0;
     size_t nodeID = 0;
     while (isValidNode(nodeID)) { ++numLevels; nodeID = leftChildOf(nodeID); }
-    PRINT(numLevels);
+    if (verbose) PRINT(numLevels);
 
-    const box3f &bounds = model->getBounds();
-    std::cout << "#osp:pkd: bounds of model " << bounds << std::endl;
-    std::cout << "#osp:pkd: number of input particles " << numParticles << std::endl;
-    buildRec(0,bounds,0);
+    if (builder == BUILDER_SELECT)
+      buildSelect(bounds);
+    else
+      buildRec(0,bounds,0);
+  }
+
+  /*! the split dimension the swap-builder would choose for a node */
+  __forceinline size_t splitDimOf(const box3f &bounds, const size_t depth)
+  {
+#if DIM_ROUND_ROBIN
+    return depth % 3;
+#else
+    (void)depth;
+    return maxDim(bounds.size());
+#endif
+  }
+
+  /*! a node whose subtree is still to be built by the select-builder:
+      its subtree occupies the range [begin,begin+subtreeSize) of the
+      'order' array */
+  struct SelectJob {
+    size_t nodeID;
+    size_t begin;
+    box3f  bounds;
+  };
+
+  /*! place the median of the subtree rooted at nodeID into the heap
+      and return the split dim; after this 'order' has the left
+      subtree's particles in [begin,begin+numLeft), and the right ones
+      in [begin+numLeft+1,end) */
+  inline size_t selectMedian(const PartiKD *pkd,
+                             std::vector<PKDItem> &order,
+                             const size_t nodeID, const size_t begin,
+                             const box3f &bounds, const size_t depth,
+                             size_t &numLeft)
+  {
+    const size_t N   = pkd->numParticles;
+    const size_t end = begin+PartiKD::subtreeSizeOf(nodeID,N);
+    if (!pkd->hasLeftChild(nodeID)) {
+      pkd->item[nodeID] = order[begin];
+      numLeft = 0;
+      return 0;
+    }
+    const size_t dim = splitDimOf(bounds,depth);
+    numLeft = PartiKD::subtreeSizeOf(PartiKD::leftChildOf(nodeID),N);
+    std::nth_element(order.begin()+begin,
+                     order.begin()+begin+numLeft,
+                     order.begin()+end,
+                     [&](const PKDItem &a, const PKDItem &b){ return a.pos[dim] < b.pos[dim]; });
+    pkd->item[nodeID] = order[begin+numLeft];
+    pkd->setDim(nodeID,dim);
+    return dim;
+  }
+
+  void PartiKD::buildSelectRec(std::vector<PKDItem> &order,
+                               const size_t nodeID,
+                               const size_t begin,
+                               const box3f &bounds,
+                               const size_t depth) const
+  {
+    size_t numLeft;
+    const size_t dim = selectMedian(this,order,nodeID,begin,bounds,depth,numLeft);
+    if (!hasLeftChild(nodeID)) 
+      return;
+
+    box3f lBounds = bounds;
+    box3f rBounds = bounds;
+    lBounds.upper[dim] = rBounds.lower[dim] = pos(nodeID,dim);
+
+    if (!hasRightChild(nodeID)) {
+      buildSelectRec(order,leftChildOf(nodeID),begin,lBounds,depth+1);
+    } else if (numLeft >= PARALLEL_BUILD_THRESHOLD) {
+      tasking::parallel_for(2,[&](int side){
+          if (side == 0)
+            buildSelectRec(order,leftChildOf(nodeID),begin,lBounds,depth+1);
+          else
+            buildSelectRec(order,rightChildOf(nodeID),begin+numLeft+1,rBounds,depth+1);
+        });
+    } else {
+      buildSelectRec(order,leftChildOf(nodeID),begin,lBounds,depth+1);
+      buildSelectRec(order,rightChildOf(nodeID),begin+numLeft+1,rBounds,depth+1);
+    }
+  }
+
+  /*! \brief median-selection build
+
+      Rather than partitioning in the heap layout, we keep each
+      subtree's particles in one contiguous range of a separate array,
+      and place each subtree's median with a (linear-time) nth_element
+      over that range, directly into its final heap slot. The top
+      levels are processed level by level (so we can report the time
+      per level), everything below that depth-first, in parallel. */
+  void PartiKD::buildSelect(const box3f &bounds)
+  {
+    std::vector<PKDItem> order(item,item+numParticles);
+
+    std::vector<SelectJob> level(1);
+    level[0].nodeID = 0;
+    level[0].begin  = 0;
+    level[0].bounds = bounds;
+    size_t depth = 0;
+    // go breadth-first until subtrees get small enough to be
+    // balanced across threads on their own
+    while (!level.empty() && depth < SELECT_MAX_BFS_LEVELS) {
+      const double t0 = getSysTime();
+      std::vector<SelectJob> nextLevel(2*level.size());
+      tasking::parallel_for(level.size(),[&](size_t jobID){
+          const SelectJob &job = level[jobID];
+          SelectJob *children = &nextLevel[2*jobID];
+          children[0].nodeID = children[1].nodeID = (size_t)-1;
+          size_t numLeft;
+          const size_t dim = selectMedian(this,order,job.nodeID,job.begin,
+                                          job.bounds,depth,numLeft);
+          if (!hasLeftChild(job.nodeID)) return;
+          const float split = pos(job.nodeID,dim);
+          children[0].nodeID = leftChildOf(job.nodeID);
+          children[0].begin  = job.begin;
+          children[0].bounds = job.bounds;
+          children[0].bounds.upper[dim] = split;
+          if (!hasRightChild(job.nodeID)) return;
+          children[1].nodeID = rightChildOf(job.nodeID);
+          children[1].begin  = job.begin+numLeft+1;
+          children[1].bounds = job.bounds;
+          children[1].bounds.lower[dim] = split;
+        });
+      level.clear();
+      for (size_t i=0;i<nextLevel.size();i++)
+        if (nextLevel[i].nodeID != (size_t)-1)
+          level.push_back(nextLevel[i]);
+      const double t1 = getSysTime();
+      if (verbose)
+        printf("#osp:pkd: level %2li: %8li nodes, %.3f sec\n",
+               depth,nextLevel.size()/2,t1-t0);
+      ++depth;
+    }
+
+    if (!level.empty()) {
+      const double t0 = getSysTime();
+      tasking::parallel_for(level.size(),[&](size_t jobID){
+          const SelectJob &job = level[jobID];
+          buildSelectRec(order,job.nodeID,job.begin,job.bounds,depth);
+        });
+      const double t1 = getSysTime();
+      if (verbose)
+        printf("#osp:pkd: levels %li..%li: %.3f sec\n",depth,numLevels-1,t1-t0);
+    }
   }
 
   //! save to xml+binary file(s)
@@ -407,25 +929,86 @@ namespace ospray {
       // fprintf(xml,"<Renderer type=\"PKDSplatter\" name=\"splat\">\n");
       //    fprintf(xml,"<PKDGeometry>\n");
 
-    box3f bounds = model->getBounds();
-    fprintf(xml,"<position ofs=\"%li\" count=\"%li\" format=\"uint64\"/>\n",
-    // fprintf(xml,"<data name=\"particles\" ofs=\"%li\" count=\"%li\" format=\"uint64\"/>\n",
-            ftell(bin),numParticles);
-    for (int i=0;i<model->position.size();i++) {
-      vec3f p = model->position[i];
-      uint64 dim = ((int&)p.x) & 3;
-      
-      uint64 ix = uint64((1<<20) * (p.x-bounds.lower.x) / (bounds.upper.x-bounds.lower.x));
-      uint64 iy = uint64((1<<20) * (p.y-bounds.lower.y) / (bounds.upper.y-bounds.lower.y));
-      uint64 iz = uint64((1<<20) * (p.z-bounds.lower.z) / (bounds.upper.z-bounds.lower.z));
-      
-      ix = std::max(std::min(ix,((uint64)1<<20)-1),(uint64)0);
-      iy = std::max(std::min(iy,((uint64)1<<20)-1),(uint64)0);
-      iz = std::max(std::min(iz,((uint64)1<<20)-1),(uint64)0);
-      
-      uint64 quantized = (ix << 2) | (iy << 22) | (iz << 42) | dim;
-      fwrite(&quantized,sizeof(quantized),1,bin);
+    const box3f bounds = model->getBounds();
+    // bounds of the particles as they decode, of all of them and of
+    // each treelet
+    box3f decodedBounds = empty;
+    std::vector<box3f> decodedTreeletBounds(treeletBounds.size(),empty);
+    // the decoded particles themselves (and their split dims), for
+    // the LOD aggregates and wide nodes
+    std::vector<vec3f> decoded((saveLOD || wideArity) ? numParticles : 0);
+    std::vector<int32_t> decodedDim(wideArity ? numParticles : 0);
+    if (frameLevels == 0) {
+      const pkd::PositionQuantization quantization = pkd::PositionQuantization::of(bounds);
+      fprintf(xml,"<position ofs=\"%li\" count=\"%li\" format=\"uint64\"/>\n",
+      // fprintf(xml,"<data name=\"particles\" ofs=\"%li\" count=\"%li\" format=\"uint64\"/>\n",
+              ftell(bin),numParticles);
+      std::vector<uint64> quantized(numParticles);
+      tasking::parallel_for(numParticles,[&](size_t i){
+          const vec3f p = model->position[i];
+          quantized[i] = quantization.encode(p,((int&)p.x) & 3);
+          if (!decoded.empty())
+            decoded[i] = quantization.decode(quantized[i]);
+          if (!decodedDim.empty())
+            decodedDim[i] = quantized[i] & 3;
+        });
+      fwrite(&quantized[0],sizeof(uint64),numParticles,bin);
+      saveQuantization(xml,quantization);
+      decodedBounds = quantization.quantize(bounds);
+      for (size_t i=0;i<treeletBounds.size();i++)
+        decodedTreeletBounds[i] = quantization.quantize(treeletBounds[i]);
+    } else {
+      // every treelet gets quantized relative to frames of its own
+      std::vector<uint32> quantized(numParticles);
+      std::vector<size_t> frameBegin(1,0);
+      for (size_t t=0;t+1<treeletBegin.size();t++)
+        frameBegin.push_back(frameBegin.back()
+                             +pkd::numFramesOf(treeletBegin[t+1]-treeletBegin[t],frameLevels));
+      std::vector<pkd::QuantizationFrame> frame(frameBegin.back());
+      tasking::parallel_for(treeletBounds.size(),[&](size_t t){
+          const size_t begin = treeletBegin[t];
+          const size_t size  = treeletBegin[t+1]-begin;
+          const pkd::BlockedLayout layout(size,blockLevels);
+          pkd::quantizeRelative((const vec3f *)&model->position[begin],size,layout,frameLevels,
+                                &quantized[begin],&frame[frameBegin[t]]);
+          for (size_t nodeID=0;nodeID<size;nodeID++) {
+            const size_t slot = layout.storageIndexOf(nodeID);
+            const pkd::QuantizationFrame &f = frame[frameBegin[t]+pkd::frameOf(nodeID,frameLevels)];
+            const vec3f p = f.decode(quantized[begin+slot]);
+            decodedTreeletBounds[t].extend(p);
+            if (!decoded.empty())
+              decoded[begin+slot] = p;
+            if (!decodedDim.empty())
+              decodedDim[begin+slot] = quantized[begin+slot] & 3;
+          }
+        });
+      for (size_t t=0;t<decodedTreeletBounds.size();t++)
+        decodedBounds.extend(decodedTreeletBounds[t]);
+      fprintf(xml,"<position ofs=\"%li\" count=\"%li\" format=\"uint32\"/>\n",
+              ftell(bin),numParticles);
+      fwrite(&quantized[0],sizeof(uint32),numParticles,bin);
+      fprintf(xml,"<quantizationFrames levels=\"%i\" ofs=\"%li\" count=\"%li\" format=\"vec3f\"/>\n",
+              frameLevels,ftell(bin),2*frame.size());
+      fwrite(&frame[0],sizeof(pkd::QuantizationFrame),frame.size(),bin);
+    }
+    saveCenterBounds(xml,decodedBounds);
+    saveLayout(xml,blockLevels);
+
+    for (size_t i=0;i<model->attribute.size();i++) {
+      ParticleModel::Attribute *attr = model->attribute[i];
+      saveQuantizedAttribute(xml,bin,attr->name,&attr->value[0]);
+    }
+    if (!model->type.empty()) {
+      std::vector<float> f(model->type.begin(),model->type.end());
+      saveQuantizedAttribute(xml,bin,"atomType",&f[0]);
     }
+    saveParticleRadius(xml,bin);
+    if (saveLOD)
+      saveLODTree(xml,bin,&decoded[0]);
+    if (wideArity)
+      saveWideNodes(xml,bin,&decoded[0],&decodedDim[0]);
+    if (treeletBounds.size() > 1)
+      saveTreelets(xml,bin,decodedTreeletBounds);
 
     if (model->radius > 0.)
       fprintf(xml,"<radius>%f</radius>\n",model->radius);
@@ -433,6 +1016,192 @@ namespace ospray {
     fprintf(xml,"</PKDGeometry>\n");
   }
 
+  void PartiKD::saveQuantizedAttribute(FILE *xml, FILE *bin, const std::string &attributeName,
+                                       const float *value)
+  {
+    float lo = 0.f, hi = 0.f;
+    if (numParticles > 0)
+      pkd::computeAttributeRange(value,numParticles,lo,hi);
+    const pkd::AttributeQuantization quantization(attributeBits,lo,hi);
+    // range (and min/max) trees have to match what gets rendered, ie,
+    // the decoded values
+    std::vector<float> decoded(numParticles);
+    fprintf(xml,"<attribute name=\"%s\" ofs=\"%li\" count=\"%li\" format=\"%s\" lo=\"%.9g\" hi=\"%.9g\"/>\n",
+            attributeName.c_str(),ftell(bin),numParticles,
+            attributeBits == 8 ? "uint8" : "uint16",lo,hi);
+    if (attributeBits == 8) {
+      std::vector<uint8_t> q(numParticles);
+      tasking::parallel_for(numParticles,[&](size_t i){
+          q[i] = quantization.encode(value[i]);
+          decoded[i] = quantization.decode(q[i]);
+        });
+      fwrite(&q[0],sizeof(uint8_t),numParticles,bin);
+    } else {
+      std::vector<uint16_t> q(numParticles);
+      tasking::parallel_for(numParticles,[&](size_t i){
+          q[i] = quantization.encode(value[i]);
+          decoded[i] = quantization.decode(q[i]);
+        });
+      fwrite(&q[0],sizeof(uint16_t),numParticles,bin);
+    }
+    // keeps the range trees (and everything after) 4-byte aligned
+    const uint32_t zero = 0;
+    fwrite(&zero,1,(4-ftell(bin)%4)%4,bin);
+    saveRangeTree(xml,bin,attributeName,&decoded[0]);
+  }
+
+  void PartiKD::saveQuantization(FILE *xml, const pkd::PositionQuantization &quantization)
+  {
+    fprintf(xml,"<quantization origin=\"%.9g %.9g %.9g\" scale=\"%.9g %.9g %.9g\"/>\n",
+            quantization.origin.x,quantization.origin.y,quantization.origin.z,
+            quantization.scale.x,quantization.scale.y,quantization.scale.z);
+  }
+
+  void PartiKD::saveRangeTree(FILE *xml, FILE *bin, const std::string &attributeName,
+                              const float *value)
+  {
+    std::vector<uint64_t> begin(treeletBegin.begin(),treeletBegin.end());
+    size_t numInnerNodes = 0;
+    for (size_t i=0;i+1<begin.size();i++)
+      numInnerNodes += (begin[i+1]-begin[i])/2;
+    if (numInnerNodes == 0)
+      return;
+
+    const pkd::Binning binning = pkd::computeBinning(value,numParticles,numBins,binningType);
+    std::vector<uint32_t> bits(numInnerNodes*binning.numWords());
+    pkd::computeRangeTree(value,&begin[0],begin.size()-1,binning,&bits[0],blockLevels);
+    const size_t ofs = ftell(bin);
+    fwrite(&bits[0],sizeof(uint32_t),bits.size(),bin);
+    const size_t edgesOfs = ftell(bin);
+    if (!binning.edges.empty())
+      fwrite(&binning.edges[0],sizeof(float),binning.edges.size(),bin);
+    saveRangeTreeElement(xml,attributeName,binning,ofs,bits.size(),edgesOfs);
+
+    if (saveMinMax) {
+      std::vector<uint32_t> minMax(numInnerNodes);
+      pkd::computeMinMaxTree(value,&begin[0],begin.size()-1,binning.lo,binning.hi,
+                             &minMax[0],blockLevels);
+      saveMinMaxTreeElement(xml,attributeName,binning,ftell(bin),numInnerNodes);
+      fwrite(&minMax[0],sizeof(uint32_t),numInnerNodes,bin);
+    }
+
+    if (saveLOD) {
+      std::vector<float> mean(numInnerNodes);
+      pkd::computeLODMean(value,&begin[0],begin.size()-1,&mean[0],blockLevels);
+      fprintf(xml,"<lodMean attribute=\"%s\" ofs=\"%li\" count=\"%li\" format=\"float\"/>\n",
+              attributeName.c_str(),ftell(bin),numInnerNodes);
+      fwrite(&mean[0],sizeof(float),numInnerNodes,bin);
+    }
+  }
+
+  void PartiKD::saveLODTree(FILE *xml, FILE *bin, const vec3f *position)
+  {
+    std::vector<uint64_t> begin(treeletBegin.begin(),treeletBegin.end());
+    size_t numInnerNodes = 0;
+    for (size_t i=0;i+1<begin.size();i++)
+      numInnerNodes += (begin[i+1]-begin[i])/2;
+    if (numInnerNodes == 0)
+      return;
+    std::vector<pkd::LODAggregate> lod(numInnerNodes);
+    pkd::computeLODTree([&](size_t i){ return position[i]; },
+                        &begin[0],begin.size()-1,&lod[0],blockLevels);
+    fprintf(xml,"<lodTree ofs=\"%li\" count=\"%li\" format=\"float\"/>\n",
+            ftell(bin),5*numInnerNodes);
+    fwrite(&lod[0],sizeof(pkd::LODAggregate),numInnerNodes,bin);
+  }
+
+  void PartiKD::saveWideNodes(FILE *xml, FILE *bin, const vec3f *position, const int32_t *dim)
+  {
+    std::vector<uint64_t> begin(treeletBegin.begin(),treeletBegin.end());
+    const int levels = pkd::wideLevelsOf(wideArity);
+    size_t numWideNodes = 0;
+    for (size_t i=0;i+1<begin.size();i++)
+      numWideNodes += pkd::numWideNodesOf(begin[i+1]-begin[i],levels);
+    std::vector<float> wide(numWideNodes*pkd::wideNodeFloatsOf(levels));
+    pkd::computeWideNodes([&](size_t i){ return position[i]; },
+                          [&](size_t i){
+                            if (dim) return dim[i];
+                            vec3f p = position[i];
+                            return ((int&)p.x) & 3;
+                          },
+                          &begin[0],begin.size()-1,levels,&wide[0],blockLevels);
+    fprintf(xml,"<wideNodes arity=\"%i\" ofs=\"%li\" count=\"%li\" format=\"float\"/>\n",
+            wideArity,ftell(bin),wide.size());
+    fwrite(&wide[0],sizeof(float),wide.size(),bin);
+  }
+
+  void PartiKD::saveMinMaxTreeElement(FILE *xml, const std::string &attributeName,
+                                      const pkd::Binning &binning,
+                                      const size_t ofs, const size_t count)
+  {
+    fprintf(xml,"<minMaxTree attribute=\"%s\" lo=\"%.9g\" hi=\"%.9g\" ofs=\"%li\" count=\"%li\" format=\"uint32\"/>\n",
+            attributeName.c_str(),binning.lo,binning.hi,ofs,count);
+  }
+
+  void PartiKD::saveRangeTreeElement(FILE *xml, const std::string &attributeName,
+                                     const pkd::Binning &binning,
+                                     const size_t ofs, const size_t count,
+                                     const size_t edgesOfs)
+  {
+    fprintf(xml,"<rangeTree attribute=\"%s\" lo=\"%.9g\" hi=\"%.9g\" ofs=\"%li\" count=\"%li\" format=\"uint32\"",
+            attributeName.c_str(),binning.lo,binning.hi,ofs,count);
+    // linear 32-bin trees look just like the ones older builders wrote
+    if (binning.numBins != 32)
+      fprintf(xml," bins=\"%i\"",binning.numBins);
+    if (!binning.edges.empty())
+      fprintf(xml," edgesOfs=\"%li\" edgesCount=\"%li\"",edgesOfs,binning.edges.size());
+    fprintf(xml,"/>\n");
+  }
+
+  void PartiKD::saveCenterBounds(FILE *xml, const box3f &bounds)
+  {
+    // 9 significant digits make floats survive the round trip exactly
+    fprintf(xml,"<centerBounds lower=\"%.9g %.9g %.9g\" upper=\"%.9g %.9g %.9g\"/>\n",
+            bounds.lower.x,bounds.lower.y,bounds.lower.z,
+            bounds.upper.x,bounds.upper.y,bounds.upper.z);
+  }
+
+  void PartiKD::saveParticleRadius(FILE *xml, FILE *bin)
+  {
+    if (model->particleRadius.empty())
+      return;
+    fprintf(xml,"<particleRadius ofs=\"%li\" count=\"%li\" format=\"float\"/>\n",
+            ftell(bin),numParticles);
+    fwrite(&model->particleRadius[0],sizeof(float),numParticles,bin);
+
+    std::vector<uint64_t> begin(treeletBegin.begin(),treeletBegin.end());
+    size_t numInnerNodes = 0;
+    for (size_t i=0;i+1<begin.size();i++)
+      numInnerNodes += (begin[i+1]-begin[i])/2;
+    if (numInnerNodes == 0)
+      return;
+    std::vector<float> maxRadius(numInnerNodes);
+    pkd::computeMaxRadiusTree(&model->particleRadius[0],&begin[0],begin.size()-1,
+                              &maxRadius[0],blockLevels);
+    fprintf(xml,"<maxRadiusTree ofs=\"%li\" count=\"%li\" format=\"float\"/>\n",
+            ftell(bin),numInnerNodes);
+    fwrite(&maxRadius[0],sizeof(float),numInnerNodes,bin);
+  }
+
+  /*! write treelet begins, and the given treelet bounds (which, for
+      quantized particles, are those of the decoded particles) */
+  void PartiKD::saveTreelets(FILE *xml, FILE *bin, const std::vector<box3f> &bounds)
+  {
+    std::vector<uint64> begin(treeletBegin.begin(),treeletBegin.end());
+    fprintf(xml,"<treeletBegin ofs=\"%li\" count=\"%li\" format=\"uint64\"/>\n",
+            ftell(bin),begin.size());
+    fwrite(&begin[0],sizeof(uint64),begin.size(),bin);
+
+    std::vector<vec3f> corners;
+    for (size_t i=0;i<bounds.size();i++) {
+      corners.push_back(bounds[i].lower);
+      corners.push_back(bounds[i].upper);
+    }
+    fprintf(xml,"<treeletBounds ofs=\"%li\" count=\"%li\" format=\"vec3f\"/>\n",
+            ftell(bin),corners.size());
+    fwrite(&corners[0],sizeof(vec3f),corners.size(),bin);
+  }
+
   //! save to xml+binary file(s)
   void PartiKD::saveOSP(FILE *xml, FILE *bin)
   {
@@ -441,20 +1210,31 @@ namespace ospray {
     fprintf(xml,"<position ofs=\"%li\" count=\"%li\" format=\"vec3f\"/>\n",
             ftell(bin),numParticles);
     fwrite(&model->position[0],sizeof(ParticleModel::vec_t),numParticles,bin);
-    for (int i=0;i<model->attribute.size();i++) {
+    saveCenterBounds(xml,model->getBounds());
+    saveLayout(xml,blockLevels);
+    for (size_t i=0;i<model->attribute.size();i++) {
       ParticleModel::Attribute *attr = model->attribute[i];
       fprintf(xml,"<attribute name=\"%s\" ofs=\"%li\" count=\"%li\" format=\"float\"/>\n",
               attr->name.c_str(),ftell(bin),numParticles);
       fwrite(&attr->value[0],sizeof(float),numParticles,bin);
+      saveRangeTree(xml,bin,attr->name,&attr->value[0]);
     }
     if (!model->type.empty()) {
       float *f = new float[model->type.size()];
-      for (int i=0;i<model->type.size();i++) f[i] = model->type[i];
+      for (size_t i=0;i<model->type.size();i++) f[i] = model->type[i];
       fprintf(xml,"<attribute name=\"atomType\" ofs=\"%li\" count=\"%li\" format=\"float\"/>\n",
               ftell(bin),numParticles);
       fwrite(f,sizeof(float),numParticles,bin);
+      saveRangeTree(xml,bin,"atomType",f);
       delete[] f;
     }
+    saveParticleRadius(xml,bin);
+    if (saveLOD)
+      saveLODTree(xml,bin,(const vec3f *)&model->position[0]);
+    if (wideArity)
+      saveWideNodes(xml,bin,(const vec3f *)&model->position[0],NULL);
+    if (treeletBounds.size() > 1)
+      saveTreelets(xml,bin,treeletBounds);
     if (model->radius > 0.)
       fprintf(xml,"<radius>%f</radius>\n",model->radius);
     fprintf(xml,"<useOldAlphaSpheresCode value=\"0\"/>\n");
@@ -464,12 +1244,106 @@ namespace ospray {
     // fprintf(xml,"</Renderer>\n");
   }
 
+  /*! have 'save' write an xml .pkd (plus .pkdbin) pair next to
+      'fileName', and turn that into a single container file */
+  template<typename SaveFct>
+  void saveContainer(const std::string &fileName, const SaveFct &save)
+  {
+    const std::string xmlFileName = fileName + ".xml";
+    save(xmlFileName);
+    std::cout << "#osp:pkd: converting to container " << fileName << endl;
+    pkd::convertToContainer(xmlFileName,fileName);
+    remove(xmlFileName.c_str());
+    remove((xmlFileName+"bin").c_str());
+  }
+
+  //! size of the given input file (0 for generated inputs, like RANDOM)
+  static size_t inputFileSize(const ospcommon::FileName &fileName)
+  {
+    struct stat st;
+    return stat(fileName.c_str(),&st) == 0 ? size_t(st.st_size) : 0;
+  }
+
+  static void printLoadTime(const std::string &what, size_t numParticles,
+                            size_t numBytes, double seconds)
+  {
+    cout << "#osp:pkd: loaded " << what << ": " << numParticles << " particles";
+    if (numBytes)
+      cout << ", " << (numBytes>>20) << " MB in " << seconds << " sec ("
+           << (numBytes/(1024.*1024.)/std::max(seconds,1e-6)) << " MB/s)";
+    else
+      cout << " in " << seconds << " sec";
+    cout << endl;
+  }
+
+  /*! load every input into its own part (starting out with 'radius'),
+      reading up to 'numThreads' of them at the same time; importers
+      may in turn parse each file in parallel. throws the error of the
+      first input (in order) that failed to load */
+  static void loadParts(const std::vector<ospcommon::FileName> &input, float radius,
+                        int numThreads, std::vector<ParticleModel> &part)
+  {
+    part.clear();
+    part.resize(input.size());
+    std::vector<std::exception_ptr> error(input.size());
+    std::atomic<size_t> nextInput(0);
+    std::mutex outputMutex;
+    auto loadInputs = [&]() {
+      for (size_t i;(i = nextInput++) < input.size();) {
+        try {
+          const double t0 = getSysTime();
+          part[i].radius = radius;
+          part[i].load(input[i]);
+          const double t1 = getSysTime();
+          std::lock_guard<std::mutex> lock(outputMutex);
+          printLoadTime(input[i].str(),part[i].position.size(),inputFileSize(input[i]),t1-t0);
+        } catch (...) {
+          error[i] = std::current_exception();
+        }
+      }
+    };
+    const double t0 = getSysTime();
+    std::vector<std::thread> thread;
+    for (int t=1;t<std::min(numThreads,int(input.size()));t++)
+      thread.push_back(std::thread(loadInputs));
+    loadInputs();
+    for (size_t t=0;t<thread.size();t++)
+      thread[t].join();
+    for (size_t i=0;i<input.size();i++)
+      if (error[i])
+        std::rethrow_exception(error[i]);
+    if (input.size() > 1) {
+      size_t numParticles = 0, numBytes = 0;
+      for (size_t i=0;i<input.size();i++) {
+        numParticles += part[i].position.size();
+        numBytes += inputFileSize(input[i]);
+      }
+      printLoadTime(std::to_string(input.size())+" files",numParticles,numBytes,getSysTime()-t0);
+    }
+  }
+
   void partiKDMain(int ac, char **av)
   {
     std::vector<ospcommon::FileName> input;
     std::string output, outputQuantized;
     ParticleModel model;
     bool roundRobin = false;
+    PartiKD::Builder builder = PartiKD::BUILDER_SWAP;
+    std::string scratchDir;
+    size_t memoryBudget = 0;
+    size_t numTreelets = 1;
+    int numBins = 32;
+    pkd::BinningType binningType = pkd::BINNING_LINEAR;
+    bool saveMinMax = false;
+    bool saveLOD = false;
+    int wideArity = 0;
+    int blockLevels = 0;
+    int attributeBits = 16;
+    int frameLevels = 0;
+    std::string radiusAttribute;
+    bool container = false;
+    std::string convertInput;
+    int ioThreads = 1;
 
     for (int i=1;i<ac;i++) {
       std::string arg = av[i];
@@ -478,12 +1352,65 @@ namespace ospray {
           output = av[++i];
         } else if (arg == "--radius") {
           model.radius = atof(av[++i]);
+        } else if (arg == "--radius-attribute") {
+          radiusAttribute = av[++i];
         } else if (arg == "--quantize") {
           if (i+1 >= ac || av[i+1][0] == '-')
             throw std::runtime_error("no filename passed to '--quantize'");
           outputQuantized = av[++i];
         } else if (arg == "--round-robin") {
           roundRobin = true;
+        } else if (arg == "--builder=select") {
+          builder = PartiKD::BUILDER_SELECT;
+        } else if (arg == "--builder=swap") {
+          builder = PartiKD::BUILDER_SWAP;
+        } else if (arg == "--treelets") {
+          numTreelets = atol(av[++i]);
+          if (numTreelets < 1)
+            throw std::runtime_error("invalid number of treelets");
+        } else if (arg == "--bins") {
+          numBins = atoi(av[++i]);
+          if (numBins <= 0 || numBins > pkd::RANGE_TREE_MAX_BINS || numBins % 32)
+            throw std::runtime_error("invalid number of bins (has to be 32, 64, 96, or 128)");
+        } else if (arg == "--binning") {
+          binningType = pkd::binningTypeOf(av[++i]);
+        } else if (arg == "--blocked-layout") {
+          blockLevels = atoi(av[++i]);
+          if (blockLevels < 1 || blockLevels > PKD_MAX_BLOCK_LEVELS)
+            throw std::runtime_error("invalid number of levels per block (has to be in [1..16])");
+        } else if (arg == "--quantize-attributes") {
+          attributeBits = atoi(av[++i]);
+          if (attributeBits != 8 && attributeBits != 16)
+            throw std::runtime_error("invalid number of bits per quantized attribute (has to be 8 or 16)");
+        } else if (arg == "--quantize-relative") {
+          frameLevels = atoi(av[++i]);
+          if (frameLevels < 1 || frameLevels > PKD_MAX_BLOCK_LEVELS)
+            throw std::runtime_error("invalid number of levels per quantization frame (has to be in [1..16])");
+        } else if (arg == "--min-max") {
+          saveMinMax = true;
+        } else if (arg == "--lod") {
+          saveLOD = true;
+        } else if (arg == "--wide") {
+          wideArity = atoi(av[++i]);
+          pkd::wideLevelsOf(wideArity);
+        } else if (arg == "--out-of-core") {
+          if (i+1 >= ac || av[i+1][0] == '-')
+            throw std::runtime_error("no scratch directory passed to '--out-of-core'");
+          scratchDir = av[++i];
+        } else if (arg == "--container") {
+          container = true;
+        } else if (arg == "--convert") {
+          if (i+1 >= ac || av[i+1][0] == '-')
+            throw std::runtime_error("no filename passed to '--convert'");
+          convertInput = av[++i];
+        } else if (arg == "--io-threads") {
+          if (i+1 >= ac || av[i+1][0] == '-')
+            throw std::runtime_error("no number of threads passed to '--io-threads'");
+          ioThreads = atoi(av[++i]);
+          if (ioThreads < 1)
+            throw std::runtime_error("invalid number of io threads");
+        } else if (arg == "--memory-budget") {
+          memoryBudget = size_t(atof(av[++i]) * (1<<20));
         } else {
           throw std::runtime_error("unknown parameter '"+arg+"'");
         }
@@ -491,6 +1418,15 @@ namespace ospray {
         input.push_back(arg);
       }
     }
+    if (convertInput != "") {
+      // an existing xml .pkd pair, no tree to build
+      if (output == "")
+        throw std::runtime_error("no output file specified");
+      cout << "#osp:pkd: converting " << convertInput << " to container " << output << endl;
+      pkd::convertToContainer(convertInput,output);
+      cout << "#osp:pkd: done." << endl;
+      return;
+    }
     if (input.empty()) {
       throw std::runtime_error("no input file(s) specified");
     }
@@ -500,10 +1436,90 @@ namespace ospray {
     if (model.radius == 0.f)
       std::cout << "#osp:pkd: no radius specified on command line" << std::endl;
 
+    if (scratchDir != "") {
+      if (memoryBudget == 0)
+        memoryBudget = size_t(sysconf(_SC_PHYS_PAGES)) * sysconf(_SC_PAGE_SIZE) / 2;
+      if (outputQuantized != "")
+        throw std::runtime_error("'--quantize' is not supported with '--out-of-core'");
+      if (numTreelets > 1)
+        throw std::runtime_error("'--treelets' is not supported with '--out-of-core'");
+      if (radiusAttribute != "")
+        throw std::runtime_error("'--radius-attribute' is not supported with '--out-of-core'");
+      if (saveLOD)
+        throw std::runtime_error("'--lod' is not supported with '--out-of-core'");
+      if (wideArity)
+        throw std::runtime_error("'--wide' is not supported with '--out-of-core'");
+      cout << "#osp:pkd: building out of core (scratch dir " << scratchDir
+           << ", memory budget " << (memoryBudget>>20) << "MB)" << endl;
+      PartiKDOutOfCore partiKD(scratchDir,memoryBudget,builder);
+      partiKD.numBins     = numBins;
+      partiKD.binningType = binningType;
+      partiKD.saveMinMax  = saveMinMax;
+      partiKD.blockLevels = blockLevels;
+      // load up to 'ioThreads' inputs at a time, and drop them once
+      // appended. a batch (taking a loaded input to be about as large
+      // as its file) has to fit into the memory budget, too - except
+      // for a single input, which has to be loaded either way
+      for (size_t begin=0,end;begin<input.size();begin=end) {
+        size_t batchBytes = inputFileSize(input[begin]);
+        for (end=begin+1;end<input.size() && end-begin<size_t(ioThreads);end++) {
+          const size_t bytes = inputFileSize(input[end]);
+          if (batchBytes+bytes > memoryBudget)
+            break;
+          batchBytes += bytes;
+        }
+        if (batchBytes > memoryBudget)
+          cout << "#osp:pkd: warning: " << input[begin].str() << " alone exceeds the memory budget" << endl;
+        const std::vector<ospcommon::FileName> batch(input.begin()+begin,input.begin()+end);
+        std::vector<ParticleModel> part;
+        loadParts(batch,model.radius,ioThreads,part);
+        for (size_t i=0;i<part.size();i++) {
+          if (model.radius == 0.f)
+            model.radius = part[i].radius;
+          partiKD.append(part[i]);
+        }
+      }
+      if (model.radius == 0.f) {
+        throw std::runtime_error("no radius specified via either command line or model file");
+      }
+      double before = getSysTime();
+      std::cout << "#osp:pkd: building tree ..." << std::endl;
+      if (container)
+        saveContainer(output,[&](const std::string &fileName){
+            partiKD.buildAndSave(fileName,model.radius);
+          });
+      else
+        partiKD.buildAndSave(output,model.radius);
+      double after = getSysTime();
+      std::cout << "#osp:pkd: tree built and written to " << output
+                << " (" << (after-before) << " sec)" << std::endl;
+      std::cout << "#osp:pkd: done." << endl;
+      return;
+    }
+
     // load the input(s)
-    for (int i=0;i<input.size();i++) {
-      cout << "#osp:pkd: loading " << input[i] << endl;
-      model.load(input[i]);
+    if (ioThreads > 1 && input.size() > 1) {
+      // concurrently, each into a part of its own, then concatenated
+      std::vector<ParticleModel> part;
+      loadParts(input,model.radius,ioThreads,part);
+      const double t0 = getSysTime();
+      model.append(part);
+      cout << "#osp:pkd: concatenated " << part.size() << " files in "
+           << (getSysTime()-t0) << " sec" << endl;
+    } else {
+      for (size_t i=0;i<input.size();i++) {
+        cout << "#osp:pkd: loading " << input[i] << endl;
+        const size_t numParticles = model.position.size();
+        const double t0 = getSysTime();
+        model.load(input[i]);
+        printLoadTime(input[i].str(),model.position.size()-numParticles,
+                      inputFileSize(input[i]),getSysTime()-t0);
+      }
+    }
+    if (radiusAttribute != "") {
+      model.setRadiusFromAttribute(radiusAttribute);
+      cout << "#osp:pkd: per-particle radii from attribute '" << radiusAttribute
+           << "' (up to " << model.radius << ")" << endl;
     }
 
     if (model.radius == 0.f) {
@@ -552,16 +1568,33 @@ namespace ospray {
 
     double before = getSysTime();
     std::cout << "#osp:pkd: building tree ..." << std::endl;
-    PartiKD partiKD(roundRobin);
+    PartiKD partiKD(roundRobin,builder);
+    partiKD.numTreelets = numTreelets;
+    partiKD.numBins     = numBins;
+    partiKD.binningType = binningType;
+    partiKD.saveMinMax  = saveMinMax;
+    partiKD.saveLOD     = saveLOD;
+    partiKD.wideArity   = wideArity;
+    partiKD.blockLevels = blockLevels;
+    partiKD.attributeBits = attributeBits;
+    partiKD.frameLevels   = frameLevels;
     partiKD.build(&model);
     double after = getSysTime();
     std::cout << "#osp:pkd: tree built (" << (after-before) << " sec)" << std::endl;
 
     std::cout << "#osp:pkd: writing binary data to " << output << endl;
-    partiKD.saveOSP(output);
+    if (container)
+      saveContainer(output,[&](const std::string &fileName){ partiKD.saveOSP(fileName); });
+    else
+      partiKD.saveOSP(output);
     if (outputQuantized != "") {
       std::cout << "#osp:pkd: writing QUANTIZED binary data to " << outputQuantized << endl;
-      partiKD.saveOSPQuantized(outputQuantized);
+      if (container)
+        saveContainer(outputQuantized,[&](const std::string &fileName){
+            partiKD.saveOSPQuantized(fileName);
+          });
+      else
+        partiKD.saveOSPQuantized(outputQuantized);
     }
 
     std::cout << "#osp:pkd: done." << endl;
@@ -575,10 +1608,11 @@ int main(int ac, char **av)
 {
   try {
     ospray::partiKDMain(ac,av);
-  } catch (std::runtime_error(e)) {
+  } catch (const std::exception &e) {
     cout << "#osp:pkd (fatal): " << e.what() << endl;
     cout << "usage:" << endl;
-    cout << "./ospPartiKD <inputfile(s)> -o output.pkd --radius <radius> [--round-robin] [--quantize quantized.pkd]\n" << endl;
+    cout << "./ospPartiKD <inputfile(s)> -o output.pkd --radius <radius> [--radius-attribute <name>] [--round-robin] [--builder=swap|select] [--treelets <N>] [--bins <32|64|96|128>] [--binning linear|log|equalized] [--min-max] [--lod] [--wide <4|8>] [--blocked-layout <levels>] [--quantize quantized.pkd [--quantize-attributes <8|16>] [--quantize-relative <levels>]] [--out-of-core <scratchDir> [--memory-budget <MB>]] [--container] [--io-threads <N>]\n"
+         << "./ospPartiKD --convert input.pkd -o output.pkd\n" << endl;
     
   }
 }
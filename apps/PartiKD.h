@@ -17,27 +17,109 @@
 #pragma once
 
 #include "ParticleModel.h"
+#include "../ospray/PKDRangeTree.h"
+#include "../ospray/PKDQuantization.h"
+#include "../ospray/PKDLOD.h"
+#include "../ospray/PKDWide.h"
+// std
+#include <cstring>
 
 namespace ospray {
 
+  /*! maps a float to a uint32 whose unsigned order is the float order */
+  __forceinline uint32 orderedKeyOf(float f)
+  {
+    const uint32 bits = (uint32 &)f;
+    return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+  }
+
+  /*! store a node's split dim in the low two bits of its x coordinate.
+      goes through memcpy, since with strict aliasing an int access
+      to the float may get reordered against copies of the particle */
+  __forceinline void setDimBits(float &x, const int dim)
+  {
+    int bits;
+    memcpy(&bits,&x,sizeof(bits));
+    bits = (bits & ~3) | dim;
+    memcpy(&x,&bits,sizeof(bits));
+  }
+
+  /*! what the builders actually shuffle around: a particle's position,
+      plus the index it had in the input model. attributes and types
+      get re-ordered only once, after the tree is built */
+  struct PKDItem {
+    ParticleModel::vec_t pos;
+    uint64               index;
+  };
+
   //! \brief particle-kd-tree class. 
   /*! \detailed Note that this class will actually re-order the
       particle model 'in place', so the order of the particles (and
       their attribute values etc) in the modle will change when this
       tree does its thing! */
   struct PartiKD {
+    /*! which algorithm to use for building the tree */
+    typedef enum {
+      /*! in-place partitioning by repeatedly swapping with the root */
+      BUILDER_SWAP,
+      /*! median selection over contiguous ranges, followed by a
+          scatter into the (implicit) heap layout */
+      BUILDER_SELECT
+    } Builder;
+
     ParticleModel *model;
+    //! the particles being built over (only valid during build)
+    PKDItem *item;
     size_t numParticles;
     size_t numInnerNodes;
     size_t numLevels;
     int roundRobin;
+    Builder builder;
+    //! whether to print build statistics
+    bool verbose;
+    /*! number of spatially disjoint sub-trees ('treelets') to split
+        the particles into; each one is a complete pkd tree of its own */
+    size_t numTreelets;
+    /*! first particle of each treelet (plus, at the end,
+        numParticles), and bounds of each treelet's particle
+        centers. filled in by build(model), even for a single treelet */
+    std::vector<size_t> treeletBegin;
+    std::vector<box3f>  treeletBounds;
+    //! number of attribute bins in the range trees we save (32, 64, 96, or 128)
+    int numBins;
+    //! how the range trees we save map attribute values to bins
+    pkd::BinningType binningType;
+    /*! whether to also save per-inner-node attribute (min,max)
+        pairs, for clipping by attribute value */
+    bool saveMinMax;
+    /*! whether to also save per-inner-node aggregates (count,
+        centroid, radius of gyration, and mean attribute values) for
+        level-of-detail traversal, see PKDLOD.h */
+    bool saveLOD;
+    /*! arity (4 or 8) of the wide nodes to also save for k-ary
+        traversal (see PKDWide.h), or 0 for none */
+    int wideArity;
+    /*! memory layout of the saved particles (see PKDLayout.h): number
+        of tree levels per block, or 0 for plain level order */
+    int blockLevels;
+    //! bits per attribute value (8 or 16) in quantized output
+    int attributeBits;
+    /*! tree levels per frame of 32-bit, relatively quantized output
+        (see PKDQuantization.h), or 0 for 64 bits on a global lattice */
+    int frameLevels;
 
-    PartiKD(bool roundRobin=0) 
-      : model(NULL), numParticles(0), numInnerNodes(0), roundRobin(roundRobin)
+    PartiKD(bool roundRobin=0, Builder builder=BUILDER_SWAP) 
+      : model(NULL), item(NULL), numParticles(0), numInnerNodes(0), roundRobin(roundRobin),
+        builder(builder), verbose(true), numTreelets(1), numBins(32),
+        binningType(pkd::BINNING_LINEAR), saveMinMax(false), saveLOD(false), wideArity(0), blockLevels(0),
+        attributeBits(16), frameLevels(0)
     {};
 
     //! build particle tree over given model. WILL REORDER THE MODEL'S ELEMENTS
     void build(ParticleModel *model);
+    /*! build particle tree over the given items, re-ordering them into
+        heap order. does not touch (and does not need) any model */
+    void build(PKDItem *item, const size_t numItems, const box3f &bounds);
     
     //! save to xml+binary file
     void saveOSP(const std::string &fileName);
@@ -45,6 +127,41 @@ namespace ospray {
     //! save to xml+binary file(s)
     void saveOSP(FILE *xml, FILE *bin);
     void saveOSPQuantized(FILE *xml, FILE *bin);
+    void saveTreelets(FILE *xml, FILE *bin, const std::vector<box3f> &bounds);
+    /*! write the given attribute values, quantized to attributeBits
+        bits, along with their range tree */
+    void saveQuantizedAttribute(FILE *xml, FILE *bin, const std::string &attributeName,
+                                const float *value);
+    //! write the xml element describing how quantized particles decode
+    static void saveQuantization(FILE *xml, const pkd::PositionQuantization &quantization);
+    /*! write the attribute range tree (of all treelets) - and, if
+        saveMinMax is set, the min/max tree, and if saveLOD is set, the
+        per-inner-node means - for the given attribute values, which
+        have to be in tree order */
+    void saveRangeTree(FILE *xml, FILE *bin, const std::string &attributeName,
+                       const float *value);
+    /*! write the xml element describing a range tree of 'count'
+        words at 'ofs' in the binary file, with its bin edges (for
+        non-linear binnings) at 'edgesOfs' */
+    static void saveRangeTreeElement(FILE *xml, const std::string &attributeName,
+                                     const pkd::Binning &binning,
+                                     const size_t ofs, const size_t count,
+                                     const size_t edgesOfs);
+    static void saveMinMaxTreeElement(FILE *xml, const std::string &attributeName,
+                                      const pkd::Binning &binning,
+                                      const size_t ofs, const size_t count);
+    /*! write the level-of-detail aggregates of the given (as saved,
+        or as they decode) particle positions */
+    void saveLODTree(FILE *xml, FILE *bin, const vec3f *position);
+    /*! write the wide nodes of the given (as saved, or as they
+        decode) particle positions, whose split dims are in 'dim' - or,
+        if that's NULL, in the positions' x coordinates */
+    void saveWideNodes(FILE *xml, FILE *bin, const vec3f *position, const int32_t *dim);
+    /*! write the per-particle radii (if the model has them), along
+        with their max radius tree */
+    void saveParticleRadius(FILE *xml, FILE *bin);
+    //! write the bounds of the (as saved) particle centers to the xml file
+    static void saveCenterBounds(FILE *xml, const box3f &bounds);
 
     /*! @{ \brief Balanced KD-tree helper functions */
     
@@ -58,13 +175,48 @@ namespace ospray {
     __forceinline bool hasLeftChild(const size_t nodeID)    const { return isValidNode(leftChildOf(nodeID)); }
     __forceinline bool hasRightChild(const size_t nodeID)   const { return isValidNode(rightChildOf(nodeID)); }
     __forceinline static size_t isValidNode(const size_t nodeID, const size_t numParticles) { return nodeID < numParticles; }
+    /*! number of nodes in the subtree rooted at nodeID */
+    static inline size_t subtreeSizeOf(const size_t nodeID, const size_t numParticles)
+    {
+      size_t size = 0;
+      size_t first = nodeID, numInLevel = 1;
+      while (first < numParticles) {
+        size += std::min(numInLevel,numParticles-first);
+        first = leftChildOf(first);
+        numInLevel += numInLevel;
+      }
+      return size;
+    }
     /*! @} */
     
-    __forceinline float pos(const size_t nodeID, const size_t dim) const { return model->position[nodeID][dim]; }
+    __forceinline float pos(const size_t nodeID, const size_t dim) const { return item[nodeID].pos[dim]; }
 
     void buildRec(const size_t nodeID, const box3f &bounds, const size_t depth) const;
 
-    //! helper function for building - swap two particles in the model
+    /*! @{ median-selection builder (BUILDER_SELECT) */
+    void buildSelect(const box3f &bounds);
+    void buildSelectRec(std::vector<PKDItem> &order,
+                        const size_t nodeID, const size_t begin,
+                        const box3f &bounds, const size_t depth) const;
+    /*! @} */
+
+    /*! @{ treelet builder: split the items into numTreelets spatially
+        coherent ranges of (about) equal size, and build a tree over each */
+    void buildTreelets(PKDItem *item, const size_t numItems);
+    void splitTreelets(PKDItem *item, const size_t begin, const size_t end,
+                       const size_t firstTreelet, const size_t numTreelets);
+    /*! @} */
+
+    /*! apply the permutation the build produced to the model's
+        positions, attributes, types, and radii */
+    void reorderModel();
+    /*! re-order the (built) items of each treelet from level order
+        into the blockLevels layout */
+    void applyLayout(PKDItem *item) const;
+    //! write the xml element describing the layout (if not level order)
+    static void saveLayout(FILE *xml, const int blockLevels);
+
+    //! helper function for building - swap two particles
     inline void swap(const size_t a, const size_t b) const;
 
     // save the given particle's split dimension
@@ -0,0 +1,474 @@
+// ======================================================================== //
+// Copyright 2009-2014 Intel Corporation                                    //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "PartiKDOutOfCore.h"
+#include "../ospray/PKDBounds.h"
+#include "../ospray/PKDRangeTree.h"
+
+#include "ospcommon/tasking/parallel_for.h"
+
+// std
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+// posix
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*! number of particles per block in the parallel passes over mapped data */
+#define OOC_BLOCK_SIZE (1<<20)
+
+namespace ospray {
+  using std::endl;
+  using std::cout;
+
+  /*! a file mapped into memory; optionally created (with the given size) */
+  struct MappedFile {
+    MappedFile(const std::string &fileName, size_t size, bool create)
+      : size(size)
+    {
+      fd = create
+        ? open(fileName.c_str(),O_RDWR|O_CREAT|O_TRUNC,0644)
+        : open(fileName.c_str(),O_RDWR);
+      if (fd < 0)
+        throw std::runtime_error("could not open '"+fileName+"'");
+      if (create && ftruncate(fd,size) != 0)
+        throw std::runtime_error("could not resize '"+fileName+"'");
+      ptr = size == 0 ? NULL : (unsigned char *)mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+      if (ptr == MAP_FAILED)
+        throw std::runtime_error("could not mmap '"+fileName+"'");
+    }
+    ~MappedFile()
+    {
+      if (ptr) munmap(ptr,size);
+      close(fd);
+    }
+
+    unsigned char *ptr;
+    size_t size;
+    int    fd;
+  };
+
+  /*! run 'func(begin,end)' over [begin,end) in parallel blocks of OOC_BLOCK_SIZE */
+  template<typename Func>
+  inline void forEachBlock(const size_t begin, const size_t end, const Func &func)
+  {
+    const size_t numBlocks = (end-begin+OOC_BLOCK_SIZE-1)/OOC_BLOCK_SIZE;
+    tasking::parallel_for(numBlocks,[&](size_t blockID){
+        const size_t blockBegin = begin+blockID*size_t(OOC_BLOCK_SIZE);
+        const size_t blockEnd   = std::min(blockBegin+OOC_BLOCK_SIZE,end);
+        func(blockBegin,blockEnd);
+      });
+  }
+
+  PartiKDOutOfCore::PartiKDOutOfCore(const std::string &scratchDir,
+                                     const size_t memoryBudget,
+                                     PartiKD::Builder builder)
+    : numParticles(0),
+      numBins(32),
+      binningType(pkd::BINNING_LINEAR),
+      saveMinMax(false),
+      blockLevels(0),
+      scratchDir(scratchDir),
+      memoryBudget(memoryBudget),
+      builder(builder),
+      itemFile(NULL),
+      typeFile(NULL),
+      outPosition(NULL),
+      outIndex(NULL),
+      numInCoreSubtrees(0)
+  {
+    char pid[32];
+    sprintf(pid,"%i",(int)getpid());
+    itemFileName = scratchDir+"/pkd-ooc-"+pid+".items";
+    typeFileName = scratchDir+"/pkd-ooc-"+pid+".types";
+    itemFile = fopen(itemFileName.c_str(),"wb");
+    if (!itemFile)
+      throw std::runtime_error("could not create scratch file '"+itemFileName+"'");
+  }
+
+  PartiKDOutOfCore::~PartiKDOutOfCore()
+  {
+    if (itemFile) fclose(itemFile);
+    unlink(itemFileName.c_str());
+    if (typeFile) fclose(typeFile);
+    unlink(typeFileName.c_str());
+    for (size_t i=0;i<attribute.size();i++) {
+      if (attribute[i].file) fclose(attribute[i].file);
+      unlink(attribute[i].fileName.c_str());
+    }
+  }
+
+  void PartiKDOutOfCore::append(const ParticleModel &model)
+  {
+    const size_t N = model.position.size();
+    if (N == 0)
+      // nothing to write; doesn't get to define the attributes, either
+      return;
+
+    // the first model defines which attributes we expect ...
+    if (numParticles == 0) {
+      for (size_t i=0;i<model.attribute.size();i++) {
+        Attribute attr;
+        attr.name = model.attribute[i]->name;
+        char num[32];
+        sprintf(num,"%i",int(i));
+        attr.fileName = itemFileName+".attr"+num;
+        attr.file = fopen(attr.fileName.c_str(),"wb");
+        if (!attr.file)
+          throw std::runtime_error("could not create scratch file '"+attr.fileName+"'");
+        attribute.push_back(attr);
+      }
+      if (!model.type.empty()) {
+        typeFile = fopen(typeFileName.c_str(),"wb");
+        if (!typeFile)
+          throw std::runtime_error("could not create scratch file '"+typeFileName+"'");
+      }
+    }
+    // ... and all others have to match
+    if (model.attribute.size() != attribute.size())
+      throw std::runtime_error("out-of-core builder: all inputs need the same attributes");
+    if (model.type.empty() != (typeFile == NULL))
+      throw std::runtime_error("out-of-core builder: either all or no inputs need atom types");
+
+    std::vector<PKDItem> items(N);
+    tasking::parallel_for(N,[&](size_t i){
+        items[i].pos   = model.position[i];
+        items[i].index = numParticles+i;
+      });
+    fwrite(&items[0],sizeof(PKDItem),N,itemFile);
+
+    for (size_t i=0;i<attribute.size();i++) {
+      const ParticleModel::Attribute *attr = NULL;
+      for (size_t j=0;j<model.attribute.size();j++)
+        if (model.attribute[j]->name == attribute[i].name)
+          attr = model.attribute[j];
+      if (!attr)
+        throw std::runtime_error("out-of-core builder: input is missing attribute '"
+                                 +attribute[i].name+"'");
+      fwrite(&attr->value[0],sizeof(float),N,attribute[i].file);
+    }
+
+    if (typeFile) {
+      // type IDs are per model; re-map them through their names
+      std::vector<int> globalID(model.atomType.size());
+      for (size_t i=0;i<model.atomType.size();i++) {
+        const std::string &name = model.atomType[i]->name;
+        if (typeIDByName.find(name) == typeIDByName.end()) {
+          typeIDByName[name] = typeName.size();
+          typeName.push_back(name);
+        }
+        globalID[i] = typeIDByName[name];
+      }
+      std::vector<int> type(N);
+      for (size_t i=0;i<N;i++)
+        type[i] = globalID[model.type[i]];
+      fwrite(&type[0],sizeof(int),N,typeFile);
+    }
+
+    numParticles += N;
+  }
+
+  void PartiKDOutOfCore::emit(const size_t nodeID, const PKDItem &particle, const int dim)
+  {
+    const size_t slot = layout.storageIndexOf(nodeID);
+    outPosition[slot] = particle.pos;
+    outIndex[slot]    = particle.index;
+    setDimBits(outPosition[slot].x,dim);
+  }
+
+  /*! memory buildInCore takes for a subtree of 'size' particles: the
+      subtree's (mapped) items get copied into memory, and the select
+      builder makes another copy of those as its 'order' array */
+  size_t PartiKDOutOfCore::inCoreBytesOf(const size_t size) const
+  {
+    const size_t numCopies = builder == PartiKD::BUILDER_SELECT ? 3 : 2;
+    return numCopies*size*sizeof(PKDItem);
+  }
+
+  /*! build the subtree rooted at nodeID (whose particles are
+      item[begin..begin+subtreeSize)) in memory, then scatter it into
+      the global heap. any subtree of a left-balanced tree is itself a
+      left-balanced tree, so level k of the local tree maps to a
+      contiguous range in level k below nodeID */
+  void PartiKDOutOfCore::buildInCore(PKDItem *item, const size_t nodeID, const size_t begin,
+                                     const box3f &bounds)
+  {
+    const size_t size = PartiKD::subtreeSizeOf(nodeID,numParticles);
+    std::vector<PKDItem> local(item+begin,item+begin+size);
+
+    PartiKD pkd(false,builder);
+    pkd.verbose = false;
+    pkd.build(&local[0],size,bounds);
+
+    size_t localBegin = 0, globalBegin = nodeID, numInLevel = 1;
+    while (localBegin < size) {
+      const size_t count = std::min(numInLevel,size-localBegin);
+      for (size_t i=0;i<count;i++) {
+        const size_t slot = layout.storageIndexOf(globalBegin+i);
+        outPosition[slot] = local[localBegin+i].pos;
+        outIndex[slot]    = local[localBegin+i].index;
+      }
+      localBegin += numInLevel;
+      globalBegin = PartiKD::leftChildOf(globalBegin);
+      numInLevel += numInLevel;
+    }
+    numInCoreSubtrees++;
+  }
+
+  void PartiKDOutOfCore::buildRec(PKDItem *item, const size_t nodeID, const size_t begin,
+                                  const box3f &bounds, const size_t depth)
+  {
+    const size_t size = PartiKD::subtreeSizeOf(nodeID,numParticles);
+    if (inCoreBytesOf(size) <= memoryBudget || size == 1) {
+      buildInCore(item,nodeID,begin,bounds);
+      return;
+    }
+
+    double t0 = getSysTime();
+    const size_t end = begin+size;
+    const int dim = maxDim(bounds.size());
+    const size_t numLeft = PartiKD::subtreeSizeOf(PartiKD::leftChildOf(nodeID),numParticles);
+
+    // find the key of rank 'numLeft' with a radix select, 8 bits per
+    // pass; each pass is one sequential (parallel) sweep over the range
+    uint32 prefix = 0, prefixMask = 0;
+    size_t rank = numLeft;
+    for (int shift=24;shift>=0;shift-=8) {
+      std::vector<size_t> count(256,0);
+      std::mutex mutex;
+      forEachBlock(begin,end,[&](size_t blockBegin, size_t blockEnd){
+          size_t blockCount[256] = { 0 };
+          for (size_t i=blockBegin;i<blockEnd;i++) {
+            const uint32 key = orderedKeyOf(item[i].pos[dim]);
+            if ((key & prefixMask) == prefix)
+              blockCount[(key >> shift) & 0xff]++;
+          }
+          std::lock_guard<std::mutex> lock(mutex);
+          for (int b=0;b<256;b++) count[b] += blockCount[b];
+        });
+      int bucket = 0;
+      while (rank >= count[bucket]) rank -= count[bucket++];
+      prefix     |= uint32(bucket) << shift;
+      prefixMask |= 0xffu << shift;
+    }
+    const uint32 medianKey = prefix;
+
+    // three-way partition around the median key; all three cursors
+    // walk the range sequentially
+    size_t lo = begin, mid = begin, hi = end;
+    while (mid < hi) {
+      const uint32 key = orderedKeyOf(item[mid].pos[dim]);
+      if (key < medianKey)
+        std::swap(item[lo++],item[mid++]);
+      else if (key > medianKey)
+        std::swap(item[mid],item[--hi]);
+      else
+        mid++;
+    }
+    // [lo,hi) all equal the median, and begin+numLeft is in there
+    const PKDItem median = item[begin+numLeft];
+    emit(nodeID,median,dim);
+
+    double t1 = getSysTime();
+    printf("#osp:pkd(ooc): node %li (%li particles) partitioned in %.3f sec\n",
+           nodeID,size,t1-t0);
+
+    box3f lBounds = bounds;
+    box3f rBounds = bounds;
+    lBounds.upper[dim] = rBounds.lower[dim] = median.pos[dim];
+    buildRec(item,PartiKD::leftChildOf(nodeID),begin,lBounds,depth+1);
+    if (PartiKD::isValidNode(PartiKD::rightChildOf(nodeID),numParticles))
+      buildRec(item,PartiKD::rightChildOf(nodeID),begin+numLeft+1,rBounds,depth+1);
+  }
+
+  /*! re-order the attributes into heap order, i.e., out[i] =
+      value[outIndex[i]]. rather than reading the (mapped) attribute
+      files in that random order, the output slots first get sorted by
+      which block of the input they come from (a stable counting sort,
+      into another scratch file); every attribute is then gathered one
+      input block at a time, with that block read sequentially into
+      memory */
+  void PartiKDOutOfCore::gatherAttributes(unsigned char *binBasePtr, const size_t numAttributes)
+  {
+    const size_t N = numParticles;
+    const size_t blockSize = std::min(N,std::max(size_t(OOC_BLOCK_SIZE),memoryBudget/sizeof(float)));
+    const size_t numBlocks = (N+blockSize-1)/blockSize;
+
+    // count, per pass block and input block, how many slots go where
+    const size_t numPassBlocks = (N+OOC_BLOCK_SIZE-1)/OOC_BLOCK_SIZE;
+    std::vector<size_t> count(numPassBlocks*numBlocks,0);
+    forEachBlock(0,N,[&](size_t blockBegin, size_t blockEnd){
+        size_t *blockCount = &count[(blockBegin/OOC_BLOCK_SIZE)*numBlocks];
+        for (size_t i=blockBegin;i<blockEnd;i++)
+          blockCount[outIndex[i]/blockSize]++;
+      });
+    // ... turn that into where each pass block writes its slots ...
+    std::vector<size_t> bucketBegin(numBlocks+1,0);
+    size_t sum = 0;
+    for (size_t b=0;b<numBlocks;b++) {
+      bucketBegin[b] = sum;
+      for (size_t p=0;p<numPassBlocks;p++) {
+        const size_t c = count[p*numBlocks+b];
+        count[p*numBlocks+b] = sum;
+        sum += c;
+      }
+    }
+    bucketBegin[numBlocks] = sum;
+    // ... and write them
+    MappedFile slots(itemFileName+".gather",N*sizeof(uint64),true);
+    unlink((itemFileName+".gather").c_str());
+    uint64 *slot = (uint64 *)slots.ptr;
+    forEachBlock(0,N,[&](size_t blockBegin, size_t blockEnd){
+        size_t *next = &count[(blockBegin/OOC_BLOCK_SIZE)*numBlocks];
+        for (size_t i=blockBegin;i<blockEnd;i++)
+          slot[next[outIndex[i]/blockSize]++] = i;
+      });
+
+    std::vector<float> in(blockSize);
+    for (size_t a=0;a<numAttributes;a++) {
+      const bool isType = (a == attribute.size());
+      const std::string &fileName = isType ? typeFileName : attribute[a].fileName;
+      MappedFile file(fileName,N*sizeof(float),false);
+      madvise(file.ptr,file.size,MADV_SEQUENTIAL);
+      float *out = (float *)(binBasePtr + N*sizeof(ParticleModel::vec_t) + a*N*sizeof(float));
+      for (size_t b=0;b<numBlocks;b++) {
+        const size_t begin = b*blockSize;
+        const size_t end   = std::min(begin+blockSize,N);
+        if (isType) {
+          const int *type = (const int *)file.ptr;
+          forEachBlock(begin,end,[&](size_t blockBegin, size_t blockEnd){
+              for (size_t i=blockBegin;i<blockEnd;i++)
+                in[i-begin] = type[i];
+            });
+        } else {
+          const float *value = (const float *)file.ptr;
+          forEachBlock(begin,end,[&](size_t blockBegin, size_t blockEnd){
+              std::copy(value+blockBegin,value+blockEnd,in.begin()+(blockBegin-begin));
+            });
+        }
+        forEachBlock(bucketBegin[b],bucketBegin[b+1],[&](size_t blockBegin, size_t blockEnd){
+            for (size_t i=blockBegin;i<blockEnd;i++)
+              out[slot[i]] = in[outIndex[slot[i]]-begin];
+          });
+      }
+    }
+  }
+
+  void PartiKDOutOfCore::buildAndSave(const std::string &fileName, const float radius)
+  {
+    const size_t N = numParticles;
+    if (N == 0)
+      throw std::runtime_error("out-of-core builder: no particles");
+
+    fclose(itemFile); itemFile = NULL;
+    if (typeFile) { fclose(typeFile); typeFile = NULL; }
+    for (size_t i=0;i<attribute.size();i++) {
+      fclose(attribute[i].file);
+      attribute[i].file = NULL;
+    }
+
+    MappedFile items(itemFileName,N*sizeof(PKDItem),false);
+    PKDItem *item = (PKDItem *)items.ptr;
+    madvise(items.ptr,items.size,MADV_SEQUENTIAL);
+
+    box3f bounds = empty;
+    std::mutex mutex;
+    forEachBlock(0,N,[&](size_t blockBegin, size_t blockEnd){
+        box3f blockBounds = empty;
+        for (size_t i=blockBegin;i<blockEnd;i++)
+          blockBounds.extend(item[i].pos);
+        std::lock_guard<std::mutex> lock(mutex);
+        bounds.extend(blockBounds);
+      });
+    cout << "#osp:pkd(ooc): " << N << " particles, bounds " << bounds << endl;
+
+    const size_t numAttributes = attribute.size() + (typeName.empty() ? 0 : 1);
+    const std::string binFileName = fileName + "bin";
+    const size_t numInnerNodes = N/2;
+    // each attribute's range tree is followed by room for its bin
+    // edges, and (optionally) by its min/max tree
+    const size_t numWords = numBins/32;
+    const size_t rangeTreeBegin = N*(sizeof(ParticleModel::vec_t)+numAttributes*sizeof(float));
+    const size_t minMaxTreeOfs  = numInnerNodes*numWords*sizeof(uint32) + (numBins+1)*sizeof(float);
+    const size_t rangeTreeSize  = minMaxTreeOfs + (saveMinMax ? numInnerNodes*sizeof(uint32) : 0);
+    MappedFile bin(binFileName,rangeTreeBegin+numAttributes*rangeTreeSize,true);
+    MappedFile perm(itemFileName+".perm",N*sizeof(uint64),true);
+    unlink((itemFileName+".perm").c_str());
+    outPosition = (ParticleModel::vec_t *)bin.ptr;
+    outIndex    = (uint64 *)perm.ptr;
+    layout      = pkd::BlockedLayout(N,blockLevels);
+
+    double t0 = getSysTime();
+    buildRec(item,0,0,bounds,0);
+    double t1 = getSysTime();
+    printf("#osp:pkd(ooc): tree built in %.3f sec (%li in-core subtrees)\n",
+           t1-t0,numInCoreSubtrees);
+
+    const box3f savedBounds = pkd::computeBounds((const float *)outPosition,N);
+    gatherAttributes(bin.ptr,numAttributes);
+    double t2 = getSysTime();
+    printf("#osp:pkd(ooc): attributes re-ordered in %.3f sec\n",t2-t1);
+
+    std::vector<pkd::Binning> binning(numAttributes);
+    for (size_t a=0;a<numAttributes && numInnerNodes>0;a++) {
+      const float *value = (const float *)(bin.ptr + N*sizeof(ParticleModel::vec_t) + a*N*sizeof(float));
+      unsigned char *rangeTree = bin.ptr + rangeTreeBegin + a*rangeTreeSize;
+      binning[a] = pkd::computeBinning(value,N,numBins,binningType);
+      pkd::computeRangeTree(value,N,binning[a],(uint32_t *)rangeTree,blockLevels);
+      if (!binning[a].edges.empty())
+        memcpy(rangeTree+numInnerNodes*numWords*sizeof(uint32),
+               &binning[a].edges[0],binning[a].edges.size()*sizeof(float));
+      if (saveMinMax)
+        pkd::computeMinMaxTree(value,N,binning[a].lo,binning[a].hi,
+                               (uint32_t *)(rangeTree+minMaxTreeOfs),blockLevels);
+    }
+
+    outPosition = NULL;
+    outIndex    = NULL;
+
+    FILE *xml = fopen(fileName.c_str(),"w");
+    if (!xml)
+      throw std::runtime_error("could not create '"+fileName+"'");
+    fprintf(xml,"<?xml version=\"1.0\"?>\n");
+    fprintf(xml,"<OSPRay>\n");
+    fprintf(xml,"<PKDGeometry>\n");
+    fprintf(xml,"<position ofs=\"%li\" count=\"%li\" format=\"vec3f\"/>\n",
+            0L,N);
+    PartiKD::saveCenterBounds(xml,savedBounds);
+    PartiKD::saveLayout(xml,blockLevels);
+    for (size_t a=0;a<numAttributes;a++) {
+      const std::string &name = a < attribute.size() ? attribute[a].name : std::string("atomType");
+      fprintf(xml,"<attribute name=\"%s\" ofs=\"%li\" count=\"%li\" format=\"float\"/>\n",
+              name.c_str(),N*sizeof(ParticleModel::vec_t)+a*N*sizeof(float),N);
+      if (numInnerNodes > 0)
+        PartiKD::saveRangeTreeElement(xml,name,binning[a],
+                                      rangeTreeBegin+a*rangeTreeSize,numInnerNodes*numWords,
+                                      rangeTreeBegin+a*rangeTreeSize+numInnerNodes*numWords*sizeof(uint32));
+      if (numInnerNodes > 0 && saveMinMax)
+        PartiKD::saveMinMaxTreeElement(xml,name,binning[a],
+                                       rangeTreeBegin+a*rangeTreeSize+minMaxTreeOfs,numInnerNodes);
+    }
+    if (radius > 0.)
+      fprintf(xml,"<radius>%f</radius>\n",radius);
+    fprintf(xml,"<useOldAlphaSpheresCode value=\"0\"/>\n");
+    fprintf(xml,"</PKDGeometry>\n");
+    fprintf(xml,"</OSPRay>\n");
+    fclose(xml);
+  }
+
+}
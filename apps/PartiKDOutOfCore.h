@@ -0,0 +1,90 @@
+// ======================================================================== //
+// Copyright 2009-2014 Intel Corporation                                    //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+#include "PartiKD.h"
+
+namespace ospray {
+
+  //! \brief external-memory ('out of core') particle-kd-tree builder
+  /*! \detailed For models that do not fit into memory. Input models
+      get appended - one at a time - to scratch files; the build then
+      memory-maps those, partitions the top levels of the tree in
+      large sequential passes over the mapped data, and builds each
+      subtree that fits into the given memory budget in-core (with a
+      regular PartiKD). The result is written as the same .pkd/.pkdbin
+      pair that PartiKD::saveOSP writes. */
+  struct PartiKDOutOfCore {
+    PartiKDOutOfCore(const std::string &scratchDir,
+                     const size_t memoryBudget,
+                     PartiKD::Builder builder=PartiKD::BUILDER_SWAP);
+    ~PartiKDOutOfCore();
+
+    /*! append the given model's particles to the scratch files. the
+        model can be discarded after this call */
+    void append(const ParticleModel &model);
+
+    //! build the tree, and write it to xml+binary file
+    void buildAndSave(const std::string &fileName, const float radius);
+
+    size_t numParticles;
+    //! @{ binning of the range trees we save, whether to save min/max trees, and layout (see PartiKD)
+    int numBins;
+    pkd::BinningType binningType;
+    bool saveMinMax;
+    int blockLevels;
+    //! @}
+
+  private:
+    struct Attribute {
+      std::string name;
+      std::string fileName;
+      FILE       *file;
+    };
+
+    void buildRec(PKDItem *item, const size_t nodeID, const size_t begin,
+                  const box3f &bounds, const size_t depth);
+    void buildInCore(PKDItem *item, const size_t nodeID, const size_t begin,
+                     const box3f &bounds);
+    //! write the given particle (with split dim 'dim') to the given heap slot
+    void emit(const size_t nodeID, const PKDItem &particle, const int dim);
+    void gatherAttributes(unsigned char *binBasePtr, const size_t numAttributes);
+    //! memory it takes to build a subtree of that many particles in-core
+    size_t inCoreBytesOf(const size_t size) const;
+
+    std::string scratchDir;
+    size_t memoryBudget;
+    PartiKD::Builder builder;
+
+    std::string itemFileName;
+    FILE       *itemFile;
+    std::vector<Attribute> attribute;
+    //! atom type names, in order of the (global) type IDs we write
+    std::vector<std::string> typeName;
+    std::map<std::string,int> typeIDByName;
+    std::string typeFileName;
+    FILE       *typeFile;
+
+    //! while building: output positions and permutation, in heap order
+    ParticleModel::vec_t *outPosition;
+    uint64               *outIndex;
+    //! where in outPosition/outIndex each node goes
+    pkd::BlockedLayout    layout;
+    size_t numInCoreSubtrees;
+  };
+
+}
@@ -17,14 +17,19 @@
 #include <cmath>
 #include "ParticleModel.h"
 #include "PKDConfig.h"
+#include "../ospray/PKDBounds.h"
+#include "ospcommon/tasking/parallel_for.h"
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
 
 namespace ospray {
 
   // file importers
-  //namespace uintah { void importModel(ParticleModel *model, const ospcommon::FileName &s); }
+  namespace uintah { void importModel(ParticleModel *model, const ospcommon::FileName &s); }
   namespace xyz { void importModel(ParticleModel *model, const ospcommon::FileName &s); }
-  //namespace cosmos { void importModel(ParticleModel *model, const ospcommon::FileName &s); }
-  //namespace cosmic_web { void importModel(ParticleModel *model, const ospcommon::FileName &s); }
+  namespace cosmos { void importModel(ParticleModel *model, const ospcommon::FileName &s); }
+  namespace cosmic_web { void importModel(ParticleModel *model, const ospcommon::FileName &s); }
 #if PKD_LIDAR_ENABLED
   namespace las { void importModel(ParticleModel *model, const ospcommon::FileName &s); }
 #endif
@@ -51,14 +56,18 @@ namespace ospray {
     if (fn.ext() == "RANDOM") {
       size_t num = atol(fn.str().c_str());
       std::cout << "#osp:pkd: generating model of " << num << " random particles" << std::endl;
-      for (int i=0;i<num;i++) {
+      Attribute *random = getAttribute("random");
+      reserve(num);
+      std::vector<float> value(num);
+      for (size_t i=0;i<num;i++) {
         vec3f p(drand48(),drand48(),drand48());
         position.push_back(p);
-        addAttribute("random",
-                     std::cos(11.f*p.x+5.f*p.y+7.f*p.z)+
-                     std::cos(5.f*p.y+7.f*p.z)+
-                     std::sin(13.f*p.x*p.y+11.f*p.x)*std::cos(11.f*p.z));
+        value[i] =
+          std::cos(11.f*p.x+5.f*p.y+7.f*p.z)+
+          std::cos(5.f*p.y+7.f*p.z)+
+          std::sin(13.f*p.x*p.y+11.f*p.x)*std::cos(11.f*p.z);
       }
+      random->append(value.data(),num);
     } else if (fn.ext() == "REGULAR") {
       size_t num = atol(fn.str().c_str());
       std::cout << "#osp:pkd: generating model of " << num << " random particles" << std::endl;
@@ -68,16 +77,15 @@ namespace ospray {
             position.push_back(vec3f(x,y,z));
     } else if (fn.ext() == "xyz") {
       xyz::importModel(this,fn);
-    }/* else if (fn.ext() == "xml") {
+    } else if (fn.ext() == "cosmos") {
+      cosmos::importModel(this,fn);
+    } else if (fn.ext() == "xml") {
       // assume uintah format
       uintah::importModel(this,fn);
     } else if (fn.ext() == "dat") {
-      // assume uintah format
+      // assume cosmic web format
       cosmic_web::importModel(this,fn);
-    } else if (fn.ext() == "cosmos") {
-      // assume uintah format
-      cosmos::importModel(this,fn);
-    }*/
+    }
 #if PKD_LIDAR_ENABLED
     else if (fn.ext() == "las" || fn.ext() == "laz"){
       las::importModel(this, fn);
@@ -125,13 +133,25 @@ namespace ospray {
     }
   }
 
+  void ParticleModel::setRadiusFromAttribute(const std::string &name)
+  {
+    if (!hasAttribute(name))
+      throw std::runtime_error("no attribute '"+name+"' to take the particle radii from");
+    const Attribute *a = getAttribute(name);
+    if (a->value.size() != position.size())
+      throw std::runtime_error("attribute '"+name+"' does not have one value per particle");
+    if (!(a->minValue > 0.f))
+      throw std::runtime_error("attribute '"+name+"' has non-positive values, can't be a radius");
+    particleRadius = a->value;
+    radius = a->maxValue;
+  }
+
   //! return world bounding box of all particle *positions* (i.e., particles *ex* radius)
   box3f ParticleModel::getBounds() const
   {
-    box3f bounds = ospcommon::empty;
-    for (size_t i=0;i<position.size();i++)
-      bounds.extend(position[i]);
-    return bounds;
+    if (position.empty())
+      return ospcommon::empty;
+    return pkd::computeBounds((const float *)&position[0],position.size());
   }
 
   //! get attributeset of given name; create a new one if not yet exists */
@@ -154,10 +174,137 @@ namespace ospray {
   //! add one attribute value to set of attributes of given name
   void ParticleModel::addAttribute(const std::string &name, float value)
   {
-    ParticleModel::Attribute *a = getAttribute(name);
-    a->value.push_back(value);
-    a->minValue = std::min(a->minValue,value);
-    a->maxValue = std::max(a->maxValue,value);
+    getAttribute(name)->add(value);
+  }
+
+  void ParticleModel::reserve(size_t numMore)
+  {
+    position.reserve(position.size()+numMore);
+    for (size_t i=0;i<attribute.size();i++)
+      attribute[i]->value.reserve(attribute[i]->value.size()+numMore);
+  }
+
+  void ParticleModel::appendPositions(const vec_t *p, size_t n)
+  {
+    position.insert(position.end(),p,p+n);
+  }
+
+  void ParticleModel::append(std::vector<ParticleModel> &parts)
+  {
+    // where each part's positions and types go
+    std::vector<size_t> positionBegin(parts.size()+1,position.size());
+    std::vector<size_t> typeBegin(parts.size()+1,type.size());
+    for (size_t i=0;i<parts.size();i++) {
+      positionBegin[i+1] = positionBegin[i]+parts[i].position.size();
+      typeBegin[i+1] = typeBegin[i]+parts[i].type.size();
+    }
+
+    // ... and their attributes' values; attributes and atom types get
+    // declared in the same order as when loading the parts one after
+    // the other into this model
+    std::vector<std::vector<Attribute *> > target(parts.size());
+    std::vector<std::vector<size_t> > valueBegin(parts.size());
+    std::map<Attribute *, size_t> numValues;
+    std::vector<std::vector<int> > globalID(parts.size());
+    const float initialRadius = radius;
+    for (size_t i=0;i<parts.size();i++) {
+      for (size_t j=0;j<parts[i].attribute.size();j++) {
+        const Attribute *a = parts[i].attribute[j];
+        Attribute *t = getAttribute(a->name);
+        if (numValues.find(t) == numValues.end())
+          numValues[t] = t->value.size();
+        target[i].push_back(t);
+        valueBegin[i].push_back(numValues[t]);
+        numValues[t] += a->value.size();
+        t->minValue = std::min(t->minValue,a->minValue);
+        t->maxValue = std::max(t->maxValue,a->maxValue);
+      }
+      for (size_t j=0;j<parts[i].atomType.size();j++) {
+        const std::string &name = parts[i].atomType[j]->name;
+        if (atomTypeByName.find(name) == atomTypeByName.end()) {
+          AtomType *a = new AtomType(name);
+          a->color = makeRandomColor(atomType.size());
+          atomTypeByName[name] = atomType.size();
+          atomType.push_back(a);
+        }
+        globalID[i].push_back(atomTypeByName[name]);
+      }
+      // importers that know better override the radius
+      if (parts[i].radius != initialRadius)
+        radius = parts[i].radius;
+#if PKD_LIDAR_ENABLED
+      lidar_current_bounds.extend(parts[i].lidar_current_bounds);
+#endif
+    }
+
+    position.resize(positionBegin.back());
+    type.resize(typeBegin.back());
+    for (std::map<Attribute *, size_t>::iterator it=numValues.begin();it!=numValues.end();it++)
+      it->first->value.resize(it->second);
+
+    tasking::parallel_for(parts.size(),[&](size_t i){
+        ParticleModel &part = parts[i];
+        std::copy(part.position.begin(),part.position.end(),position.begin()+positionBegin[i]);
+        for (size_t j=0;j<part.type.size();j++)
+          type[typeBegin[i]+j] = globalID[i][part.type[j]];
+        for (size_t j=0;j<part.attribute.size();j++) {
+          const std::vector<float> &v = part.attribute[j]->value;
+          std::copy(v.begin(),v.end(),target[i][j]->value.begin()+valueBegin[i][j]);
+        }
+
+        std::vector<vec_t>().swap(part.position);
+        std::vector<int>().swap(part.type);
+        for (size_t j=0;j<part.attribute.size();j++)
+          delete part.attribute[j];
+        part.attribute.clear();
+        for (size_t j=0;j<part.atomType.size();j++)
+          delete part.atomType[j];
+        part.atomType.clear();
+        part.atomTypeByName.clear();
+      });
+  }
+
+  void ParticleModel::Attribute::append(const float *v, size_t n)
+  {
+    extendRange(v,n);
+    value.insert(value.end(),v,v+n);
+  }
+
+  void ParticleModel::Attribute::extendRange(const float *v, size_t n)
+  {
+    // running min/max in locals rather than the members (which, for
+    // all the compiler knows, 'v' could alias)
+    float lo = minValue, hi = maxValue;
+    size_t i = 0;
+#ifdef __SSE__
+    // compilers don't vectorize the scalar loop below without
+    // -ffast-math (std::min/max aren't minps/maxps for NaNs and
+    // signed zeros), so do it explicitly, eight values per step.
+    // operand order as in std::min(lo,v[i]): NaN values get skipped
+    __m128 lo0 = _mm_set1_ps(lo), lo1 = lo0;
+    __m128 hi0 = _mm_set1_ps(hi), hi1 = hi0;
+    for (;i+8<=n;i+=8) {
+      const __m128 a = _mm_loadu_ps(v+i);
+      const __m128 b = _mm_loadu_ps(v+i+4);
+      lo0 = _mm_min_ps(a,lo0);
+      lo1 = _mm_min_ps(b,lo1);
+      hi0 = _mm_max_ps(a,hi0);
+      hi1 = _mm_max_ps(b,hi1);
+    }
+    float lane_lo[4], lane_hi[4];
+    _mm_storeu_ps(lane_lo,_mm_min_ps(lo0,lo1));
+    _mm_storeu_ps(lane_hi,_mm_max_ps(hi0,hi1));
+    for (int k=0;k<4;k++) {
+      lo = std::min(lo,lane_lo[k]);
+      hi = std::max(hi,lane_hi[k]);
+    }
+#endif
+    for (;i<n;i++) {
+      lo = std::min(lo,v[i]);
+      hi = std::max(hi,v[i]);
+    }
+    minValue = lo;
+    maxValue = hi;
   }
 
 }
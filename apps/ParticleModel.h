@@ -19,6 +19,7 @@
 #include "ospcommon/constants.h"
 #include "ospcommon/FileName.h"
 // std
+#include <algorithm>
 #include <map>
 #include <vector>
 
@@ -41,6 +42,20 @@ namespace ospray {
           maxValue(-std::numeric_limits<float>::infinity()) 
       {};
 
+      //! append one value (for importers that looked up the attribute once)
+      inline void add(const float v)
+      {
+        value.push_back(v);
+        minValue = std::min(minValue,v);
+        maxValue = std::max(maxValue,v);
+      }
+
+      //! append 'n' values, updating min/max once for the whole batch
+      void append(const float *v, size_t n);
+
+      //! extend min/max by 'n' values (without appending them)
+      void extendRange(const float *v, size_t n);
+
       std::string        name;
       float              minValue, maxValue;
       std::vector<float> value;
@@ -62,6 +77,8 @@ namespace ospray {
     std::vector<vec_t> position;   //!< particle position
     std::vector<int>   type;       //!< 'type' of particle (e.g., the atom type for atomistic models)
     std::vector<Attribute *> attribute;
+    //! per-particle radius (empty if all particles have 'radius')
+    std::vector<float> particleRadius;
 #if PKD_LIDAR_ENABLED
     box3f lidar_current_bounds = ospcommon::EmptyTy();
 #endif
@@ -80,9 +97,30 @@ namespace ospray {
     //! add one attribute value to set of attributes of given name
     void addAttribute(const std::string &attribName, float attribute);
 
+    /*! make room for 'numMore' particles in 'position' and every
+        attribute declared so far (importers that know their particle
+        count call this before appending) */
+    void reserve(size_t numMore);
+
+    //! append 'n' particle positions
+    void appendPositions(const vec_t *p, size_t n);
+
+    /*! append all particles of 'parts', in order (for models loaded
+        one per input file, each starting out with this model's
+        radius): attributes get matched up by name, atom types by
+        their names, and the data is sized exactly up front and copied
+        in parallel. the parts are left empty */
+    void append(std::vector<ParticleModel> &parts);
+
     //! helper function for parser error recovery: 'clamp' all attributes to largest non-empty attribute
     void cullPartialData();
 
+    /*! use the values of the given attribute (e.g., SPH smoothing
+        lengths, or atom radii) as per-particle radii, and their
+        maximum as 'radius'. throw an exception if there is no such
+        attribute */
+    void setRadiusFromAttribute(const std::string &name);
+
     //! return world bounding box of all particle *positions* (i.e., particles *ex* radius)
     box3f getBounds() const;
 
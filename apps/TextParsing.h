@@ -0,0 +1,245 @@
+// ======================================================================== //
+// Copyright 2009-2014 Intel Corporation                                    //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+/*! \file TextParsing.h helpers for parsing (multi-GB) ascii particle
+    files in parallel: the file gets mapped, split into chunks at line
+    boundaries, and every chunk parsed by its own task, with a float
+    parser that (unlike sscanf) doesn't go through the locale and
+    format string machinery for every number */
+
+#include "ospcommon/common.h"
+#include "ospcommon/tasking/parallel_for.h"
+// std
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+// posix
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*! approximate number of bytes each parse task gets */
+#define TEXT_CHUNK_SIZE (size_t(8)<<20)
+
+namespace ospray {
+  namespace text {
+
+    /*! a file mapped (read-only) for as long as this exists */
+    struct MappedFile {
+      MappedFile(const std::string &fileName) : begin(NULL), end(NULL), size(0)
+      {
+        const int fd = open(fileName.c_str(),O_RDONLY);
+        if (fd < 0)
+          throw std::runtime_error("could not open input file "+fileName);
+        struct stat st;
+        if (fstat(fd,&st) != 0) {
+          close(fd);
+          throw std::runtime_error("could not stat input file "+fileName);
+        }
+        size = st.st_size;
+        if (size) {
+          void *ptr = mmap(NULL,size,PROT_READ,MAP_PRIVATE,fd,0);
+          if (ptr == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error("could not map input file "+fileName);
+          }
+          // all of it gets read soon, but by many tasks at once, each
+          // in its own chunk - so read ahead, but not just sequentially
+          madvise(ptr,size,MADV_WILLNEED);
+          begin = (const char *)ptr;
+        }
+        close(fd);
+        end = begin+size;
+      }
+      ~MappedFile() { if (size) munmap((void*)begin,size); }
+
+      const char *begin, *end;
+      size_t size;
+    };
+
+    //! the start of the line after the one 'p' is in (or 'end')
+    inline const char *nextLine(const char *p, const char *end)
+    {
+      const char *eol = (const char *)memchr(p,'\n',end-p);
+      return eol ? eol+1 : end;
+    }
+
+    /*! split [begin,end) into about TEXT_CHUNK_SIZE sized chunks of
+        whole lines; chunk i is [chunk[i],chunk[i+1]) */
+    inline std::vector<const char *> splitLines(const char *begin, const char *end)
+    {
+      std::vector<const char *> chunk(1,begin);
+      const size_t numChunks = std::max(size_t(1),size_t(end-begin)/TEXT_CHUNK_SIZE);
+      for (size_t i=1;i<numChunks;i++) {
+        const char *p = std::max(chunk.back(),begin+i*((end-begin)/numChunks));
+        chunk.push_back(p == begin ? p : nextLine(p-1,end));
+      }
+      chunk.push_back(end);
+      return chunk;
+    }
+
+    inline bool isSpace(const char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+    //! skip blanks (but not the end of the line)
+    inline void skipSpaces(const char *&p, const char *end)
+    {
+      while (p < end && isSpace(*p)) ++p;
+    }
+
+    //! whether there is nothing but blanks up to the end of the line
+    inline bool atEndOfLine(const char *p, const char *end)
+    {
+      skipSpaces(p,end);
+      return p == end || *p == '\n';
+    }
+
+    /*! the next blank-separated token of the line, or false at the end
+        of the line */
+    inline bool parseToken(const char *&p, const char *end,
+                           const char *&token, size_t &length)
+    {
+      skipSpaces(p,end);
+      token = p;
+      while (p < end && !isSpace(*p) && *p != '\n') ++p;
+      length = p-token;
+      return length > 0;
+    }
+
+    /*! parse a (decimal) float, correctly rounded (like strtof). the
+        digits get accumulated in an integer; if that is below 2^24 and
+        the decimal exponent at most 10 in magnitude, both are exact
+        floats, so a single float multiply or divide gives the
+        correctly rounded result. everything else (more digits, larger
+        exponents, inf, nan, hex) goes to strtof */
+    inline bool parseFloat(const char *&p, const char *end, float &f)
+    {
+      static const float pow10[] = {
+        1e0f,1e1f,1e2f,1e3f,1e4f,1e5f,1e6f,1e7f,1e8f,1e9f,1e10f
+      };
+      skipSpaces(p,end);
+      const char *s = p;
+      bool negative = false;
+      if (s < end && (*s == '-' || *s == '+'))
+        negative = *s++ == '-';
+      uint64_t mantissa = 0;
+      int digits = 0, exponent = 0;
+      bool any = false, truncated = false;
+      for (;s < end && *s >= '0' && *s <= '9';++s,any=true) {
+        if (digits < 19) {
+          mantissa = 10*mantissa+(*s-'0');
+          if (mantissa) ++digits;
+        } else {
+          ++exponent;
+          truncated = true;
+        }
+      }
+      if (s < end && *s == '.') {
+        for (++s;s < end && *s >= '0' && *s <= '9';++s,any=true) {
+          if (digits < 19) {
+            mantissa = 10*mantissa+(*s-'0');
+            if (mantissa) ++digits;
+            --exponent;
+          } else
+            truncated = true;
+        }
+      }
+      if (any && s < end && (*s == 'e' || *s == 'E')) {
+        const char *e = s+1;
+        bool negativeExp = false;
+        if (e < end && (*e == '-' || *e == '+'))
+          negativeExp = *e++ == '-';
+        if (e < end && *e >= '0' && *e <= '9') {
+          int exp = 0;
+          for (;e < end && *e >= '0' && *e <= '9';++e)
+            exp = std::min(10*exp+(*e-'0'),100000);
+          exponent += negativeExp ? -exp : exp;
+          s = e;
+        }
+      }
+      // trailing zeros after the point ("1.500000") don't count
+      while (exponent < 0 && mantissa && mantissa % 10 == 0) {
+        mantissa /= 10;
+        ++exponent;
+      }
+      const bool delimited = s == end || isSpace(*s) || *s == '\n';
+      if (any && delimited && !truncated && mantissa < (uint64_t(1)<<24)
+          && (mantissa == 0 || (exponent >= -10 && exponent <= 10))) {
+        const float value = mantissa == 0 ? 0.f
+          : exponent < 0 ? float(mantissa)/pow10[-exponent]
+          : float(mantissa)*pow10[exponent];
+        f = negative ? -value : value;
+        p = s;
+        return true;
+      }
+
+      // the slow (but complete) way, on a terminated copy of the token
+      const char *token;
+      size_t length;
+      const char *q = p;
+      if (!parseToken(q,end,token,length) || length >= 64)
+        return false;
+      char buf[64];
+      memcpy(buf,token,length);
+      buf[length] = 0;
+      char *parsedEnd;
+      f = strtof(buf,&parsedEnd);
+      if (parsedEnd != buf+length)
+        return false;
+      p = q;
+      return true;
+    }
+
+    //! parse a (decimal) integer, like atol
+    inline bool parseInt(const char *&p, const char *end, long &i)
+    {
+      skipSpaces(p,end);
+      const char *s = p;
+      bool negative = false;
+      if (s < end && (*s == '-' || *s == '+'))
+        negative = *s++ == '-';
+      if (s == end || *s < '0' || *s > '9')
+        return false;
+      long value = 0;
+      for (;s < end && *s >= '0' && *s <= '9';++s)
+        value = 10*value+(*s-'0');
+      i = negative ? -value : value;
+      p = s;
+      return true;
+    }
+
+    /*! concatenate per-chunk vectors into 'out' (appending), in
+        parallel, and free them */
+    template<typename T>
+    inline void appendChunks(std::vector<T> &out, std::vector<std::vector<T> > &chunks)
+    {
+      std::vector<size_t> begin(chunks.size()+1,out.size());
+      for (size_t i=0;i<chunks.size();i++)
+        begin[i+1] = begin[i]+chunks[i].size();
+      out.resize(begin.back());
+      ospcommon::tasking::parallel_for(chunks.size(),[&](size_t i){
+          std::copy(chunks[i].begin(),chunks[i].end(),out.begin()+begin[i]);
+          std::vector<T>().swap(chunks[i]);
+        });
+    }
+
+  }
+}
@@ -0,0 +1,111 @@
+// ======================================================================== //
+// Copyright 2009-2014 Intel Corporation                                    //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+/*! \file PKDBounds.h bounds computation for (large) particle arrays,
+    shared by the pkd builder, the pkd geometry, and the scene graph */
+
+#include "ospcommon/box.h"
+#include "ospcommon/tasking/parallel_for.h"
+// std
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+namespace ospray {
+  namespace pkd {
+
+    /*! number of particles per task */
+    enum { BOUNDS_BLOCK_SIZE = 64*1024 };
+
+    /*! bounds of 'numParticles' float3's (serial). works on 4
+        particles (12 floats) at a time, with one min and one max
+        accumulator per float, so the inner loop has no dependencies
+        across lanes and the compiler can vectorize it */
+    inline ospcommon::box3f computeBoundsSerial(const float *position, const size_t numParticles)
+    {
+      const float inf = std::numeric_limits<float>::infinity();
+      float lo[12], hi[12];
+      for (int k=0;k<12;k++) { lo[k] = +inf; hi[k] = -inf; }
+
+      const size_t numQuads = numParticles/4;
+      for (size_t i=0;i<numQuads;i++) {
+        const float *p = position + 12*i;
+        for (int k=0;k<12;k++) {
+          lo[k] = std::min(lo[k],p[k]);
+          hi[k] = std::max(hi[k],p[k]);
+        }
+      }
+      for (size_t i=4*numQuads;i<numParticles;i++) {
+        const float *p = position + 3*i;
+        for (int k=0;k<3;k++) {
+          lo[k] = std::min(lo[k],p[k]);
+          hi[k] = std::max(hi[k],p[k]);
+        }
+      }
+
+      ospcommon::box3f bounds;
+      for (int k=0;k<3;k++) {
+        bounds.lower[k] = std::min(std::min(lo[k],lo[k+3]),std::min(lo[k+6],lo[k+9]));
+        bounds.upper[k] = std::max(std::max(hi[k],hi[k+3]),std::max(hi[k+6],hi[k+9]));
+      }
+      return bounds;
+    }
+
+    /*! bounds of 'numParticles' quantized particles (serial), in
+        quantized space (i.e., as PartiKDGeometry decodes them) */
+    inline ospcommon::box3f computeBoundsSerial(const uint64_t *particle, const size_t numParticles)
+    {
+      const uint64_t mask = (1<<20)-1;
+      uint32_t lo[3] = { (uint32_t)mask, (uint32_t)mask, (uint32_t)mask };
+      uint32_t hi[3] = { 0, 0, 0 };
+      for (size_t i=0;i<numParticles;i++) {
+        const uint64_t bits = particle[i];
+        for (int k=0;k<3;k++) {
+          const uint32_t v = (bits >> (2+20*k)) & mask;
+          lo[k] = std::min(lo[k],v);
+          hi[k] = std::max(hi[k],v);
+        }
+      }
+      if (numParticles == 0)
+        return ospcommon::empty;
+      return ospcommon::box3f(ospcommon::vec3f(lo[0],lo[1],lo[2]),
+                              ospcommon::vec3f(hi[0],hi[1],hi[2]));
+    }
+
+    /*! bounds of 'numParticles' particles (float3 or quantized
+        uint64), computed by blocks in parallel */
+    template<typename T>
+    inline ospcommon::box3f computeBounds(const T *particle, const size_t numParticles)
+    {
+      enum { ELEMENTS_PER_PARTICLE = sizeof(T) == sizeof(uint64_t) ? 1 : 3 };
+      const size_t numBlocks = (numParticles+BOUNDS_BLOCK_SIZE-1)/BOUNDS_BLOCK_SIZE;
+      std::vector<ospcommon::box3f> blockBounds(numBlocks);
+      ospcommon::tasking::parallel_for(numBlocks,[&](size_t blockID){
+          const size_t begin = blockID*BOUNDS_BLOCK_SIZE;
+          const size_t end   = std::min(begin+BOUNDS_BLOCK_SIZE,numParticles);
+          blockBounds[blockID]
+            = computeBoundsSerial(particle+ELEMENTS_PER_PARTICLE*begin,end-begin);
+        });
+      ospcommon::box3f bounds = ospcommon::empty;
+      for (size_t i=0;i<numBlocks;i++)
+        bounds.extend(blockBounds[i]);
+      return bounds;
+    }
+
+  }
+}
@@ -0,0 +1,506 @@
+// ======================================================================== //
+// Copyright 2009-2014 Intel Corporation                                    //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+/*! \file PKDContainer.h single-file binary .pkd 'container': a fixed
+    header, the data of every section (positions, attributes, range
+    trees, ...) starting on a page boundary, and a table of sections
+    (name, offset, size, checksum, and properties such as the format
+    or attribute name) at the end. it holds the same elements as the
+    xml .pkd (plus .pkdbin) pair, but a loader only has to map the file
+    and read the table - no xml parsing, and every section is aligned
+    for huge pages and O_DIRECT reads.
+
+    layout (all little endian):
+      ContainerHeader, padded to PKD_CONTAINER_ALIGNMENT
+      section data, each padded to PKD_CONTAINER_ALIGNMENT
+      numSections ContainerSectionEntry's, then their properties,
+      as consecutive zero-terminated key and value strings */
+
+#include "ospcommon/tasking/parallel_for.h"
+#include "ospcommon/xml/XML.h"
+// std
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/*! current container version; loaders reject newer ones */
+#define PKD_CONTAINER_VERSION 1
+/*! alignment of the section data (and of the table) in the file */
+#define PKD_CONTAINER_ALIGNMENT size_t(4096)
+/*! bytes per separately hashed (and verified) piece of a section */
+#define PKD_CONTAINER_CHECKSUM_CHUNK (size_t(1)<<20)
+/*! max length of a section name, including the terminating zero */
+#define PKD_CONTAINER_MAX_NAME 32
+
+namespace ospray {
+  namespace pkd {
+
+    //! first eight bytes of every container
+    static const char containerMagic[8] = { 'P','K','D','T','R','E','E','\0' };
+
+    struct ContainerHeader {
+      char     magic[8];
+      uint32_t version;
+      uint32_t numSections;
+      //! alignment the file was written with
+      uint64_t alignment;
+      //! size of the whole file, to catch truncated copies
+      uint64_t fileSize;
+      //! section table (entries and properties)
+      uint64_t tableOfs;
+      uint64_t tableSize;
+      uint64_t tableChecksum;
+    };
+
+    struct ContainerSectionEntry {
+      char     name[PKD_CONTAINER_MAX_NAME];
+      //! section data, in the file
+      uint64_t ofs;
+      uint64_t size;
+      uint64_t checksum;
+      //! properties, relative to the end of the entries
+      uint64_t propsOfs;
+      uint64_t propsSize;
+    };
+
+    typedef std::map<std::string,std::string> Properties;
+
+    /*! @{ a number read from a file (a property of section 'section');
+        throws a runtime_error naming both if 'value' is anything but
+        such a number, or out of range */
+    inline uint64_t sizeOfProp(const std::string &value, const std::string &key,
+                               const std::string &section)
+    {
+      const char *begin = value.c_str();
+      char *end = NULL;
+      errno = 0;
+      const unsigned long long v = strtoull(begin,&end,10);
+      if (value.empty() || !isdigit((unsigned char)value[0]) || *end != 0 || errno == ERANGE)
+        throw std::runtime_error("invalid "+key+" in section '"+section+"'");
+      return v;
+    }
+
+    inline int intOfProp(const std::string &value, const std::string &key,
+                         const std::string &section)
+    {
+      const char *begin = value.c_str();
+      char *end = NULL;
+      errno = 0;
+      const long v = strtol(begin,&end,10);
+      if (value.empty() || end == begin || *end != 0 || errno == ERANGE
+          || v < INT_MIN || v > INT_MAX)
+        throw std::runtime_error("invalid "+key+" in section '"+section+"'");
+      return int(v);
+    }
+
+    inline float floatOfProp(const std::string &value, const std::string &key,
+                             const std::string &section)
+    {
+      const char *begin = value.c_str();
+      char *end = NULL;
+      const float v = strtof(begin,&end);
+      if (value.empty() || end == begin || *end != 0)
+        throw std::runtime_error("invalid "+key+" in section '"+section+"'");
+      return v;
+    }
+    /*! @} */
+
+    /*! a section of a .pkd file, either a container or an xml .pkd
+        (one element each); 'data' points at the loaded (or mapped)
+        section data, if any */
+    struct Section {
+      std::string name;
+      Properties  props;
+      unsigned char *data;
+      size_t ofs;
+      size_t size;
+      uint64_t checksum;
+
+      Section() : data(NULL), ofs(0), size(0), checksum(0) {}
+      //! the given property, or "" if the section doesn't have it
+      std::string prop(const std::string &key) const
+      {
+        const Properties::const_iterator it = props.find(key);
+        return it == props.end() ? std::string() : it->second;
+      }
+      //! number of elements (of the section's "format") in the data
+      size_t count() const { return sizeOfProp(prop("count"),"count",name); }
+      //! @{ the given property as a number; throws if it isn't one
+      int   intProp(const std::string &key) const { return intOfProp(prop(key),key,name); }
+      float floatProp(const std::string &key) const { return floatOfProp(prop(key),key,name); }
+      //! @}
+    };
+
+    //! size of one element of the given (.pkd) format
+    inline size_t formatSizeOf(const std::string &format)
+    {
+      if (format == "vec3f" || format == "float3") return 12;
+      if (format == "float" || format == "uint32") return 4;
+      if (format == "uint64") return 8;
+      if (format == "uint16") return 2;
+      if (format == "uint8")  return 1;
+      throw std::runtime_error("unsupported pkd format '"+format+"'");
+    }
+
+    //! FNV-1a over (8-byte) words of one checksum chunk
+    inline uint64_t checksumChunkOf(const unsigned char *data, const size_t size,
+                                    uint64_t hash=0xcbf29ce484222325ull)
+    {
+      const uint64_t prime = 0x100000001b3ull;
+      size_t i = 0;
+      for (;i+8<=size;i+=8) {
+        uint64_t word;
+        memcpy(&word,data+i,8);
+        hash = (hash ^ word) * prime;
+      }
+      for (;i<size;i++)
+        hash = (hash ^ data[i]) * prime;
+      return hash;
+    }
+
+    /*! checksum of a section: the hash over the hashes of its
+        PKD_CONTAINER_CHECKSUM_CHUNK sized pieces, so that both writing
+        (streamed) and verifying (in parallel) work one piece at a time */
+    inline uint64_t foldChecksum(const uint64_t hash, const uint64_t chunkHash)
+    {
+      return checksumChunkOf((const unsigned char *)&chunkHash,8,hash);
+    }
+
+    inline uint64_t checksumOf(const unsigned char *data, const size_t size)
+    {
+      const size_t numChunks = (size+PKD_CONTAINER_CHECKSUM_CHUNK-1)/PKD_CONTAINER_CHECKSUM_CHUNK;
+      std::vector<uint64_t> chunkHash(numChunks);
+      ospcommon::tasking::parallel_for(numChunks,[&](size_t i){
+          const size_t begin = i*PKD_CONTAINER_CHECKSUM_CHUNK;
+          chunkHash[i] = checksumChunkOf(data+begin,
+                                         std::min(size-begin,PKD_CONTAINER_CHECKSUM_CHUNK));
+        });
+      uint64_t hash = checksumChunkOf(NULL,0);
+      for (size_t i=0;i<numChunks;i++)
+        hash = foldChecksum(hash,chunkHash[i]);
+      return hash;
+    }
+
+    //! size of the given file, in bytes
+    inline size_t fileSizeOf(const std::string &fileName)
+    {
+      FILE *file = fopen(fileName.c_str(),"rb");
+      if (!file)
+        throw std::runtime_error("could not open '"+fileName+"'");
+      fseek(file,0,SEEK_END);
+      const size_t size = ftell(file);
+      fclose(file);
+      return size;
+    }
+
+    //! whether the given file starts like a container (rather than xml)
+    inline bool isContainer(const std::string &fileName)
+    {
+      FILE *file = fopen(fileName.c_str(),"rb");
+      if (!file)
+        return false;
+      char magic[sizeof(containerMagic)];
+      const bool is = fread(magic,sizeof(magic),1,file) == 1
+        && memcmp(magic,containerMagic,sizeof(magic)) == 0;
+      fclose(file);
+      return is;
+    }
+
+    /*! read (and check) the section table of a container that is
+        loaded (or mapped) at 'base'; every section's data then is a
+        pointer into that. section checksums only get checked if
+        'verify' is set, since that touches the whole file */
+    inline std::vector<Section> readContainer(unsigned char *base,
+                                              const size_t fileSize,
+                                              const bool verify=false)
+    {
+      ContainerHeader header;
+      if (fileSize < sizeof(header))
+        throw std::runtime_error("truncated pkd container (no header)");
+      memcpy(&header,base,sizeof(header));
+      if (memcmp(header.magic,containerMagic,sizeof(containerMagic)) != 0)
+        throw std::runtime_error("not a pkd container");
+      if (header.version > PKD_CONTAINER_VERSION)
+        throw std::runtime_error("pkd container version "+std::to_string(header.version)
+                                 +" is newer than this loader's ("
+                                 +std::to_string(PKD_CONTAINER_VERSION)+")");
+      if (header.fileSize != fileSize)
+        throw std::runtime_error("truncated pkd container (file has "+std::to_string(fileSize)
+                                 +" bytes, header says "+std::to_string(header.fileSize)+")");
+      const size_t entriesSize = header.numSections*sizeof(ContainerSectionEntry);
+      if (header.tableOfs > fileSize || header.tableSize > fileSize-header.tableOfs
+          || entriesSize > header.tableSize)
+        throw std::runtime_error("corrupt pkd container (section table out of bounds)");
+      const unsigned char *table = base+header.tableOfs;
+      if (checksumOf(table,header.tableSize) != header.tableChecksum)
+        throw std::runtime_error("corrupt pkd container (section table checksum mismatch)");
+
+      std::vector<Section> sections(header.numSections);
+      const char *props = (const char *)table+entriesSize;
+      const size_t propsSize = header.tableSize-entriesSize;
+      for (size_t i=0;i<sections.size();i++) {
+        ContainerSectionEntry entry;
+        memcpy(&entry,table+i*sizeof(entry),sizeof(entry));
+        if (entry.ofs > fileSize || entry.size > fileSize-entry.ofs
+            || entry.propsOfs > propsSize || entry.propsSize > propsSize-entry.propsOfs
+            || memchr(entry.name,0,sizeof(entry.name)) == NULL)
+          throw std::runtime_error("corrupt pkd container (section "+std::to_string(i)
+                                   +" out of bounds)");
+        Section &s = sections[i];
+        s.name     = entry.name;
+        s.data     = base+entry.ofs;
+        s.ofs      = entry.ofs;
+        s.size     = entry.size;
+        s.checksum = entry.checksum;
+        // key and value strings, back to back
+        const char *p   = props+entry.propsOfs;
+        const char *end = p+entry.propsSize;
+        while (p < end) {
+          const char *key = p;
+          p = (const char *)memchr(p,0,end-p);
+          if (!p) break;
+          const char *value = ++p;
+          p = (const char *)memchr(p,0,end-p);
+          if (!p)
+            throw std::runtime_error("corrupt pkd container (properties of section '"
+                                     +s.name+"')");
+          s.props[key] = value;
+          ++p;
+        }
+        if (s.prop("format") != "" && s.prop("count") != ""
+            && s.count() > s.size/formatSizeOf(s.prop("format")))
+          throw std::runtime_error("corrupt pkd container (section '"+s.name
+                                   +"' smaller than its count)");
+      }
+
+      if (verify) {
+        // one task per checksum chunk, over all sections
+        std::vector<size_t> firstChunk(sections.size()+1,0);
+        for (size_t i=0;i<sections.size();i++)
+          firstChunk[i+1] = firstChunk[i]
+            + (sections[i].size+PKD_CONTAINER_CHECKSUM_CHUNK-1)/PKD_CONTAINER_CHECKSUM_CHUNK;
+        std::vector<uint64_t> chunkHash(firstChunk.back());
+        ospcommon::tasking::parallel_for(chunkHash.size(),[&](size_t c){
+            const size_t i = std::upper_bound(firstChunk.begin(),firstChunk.end(),c)
+              - firstChunk.begin() - 1;
+            const size_t begin = (c-firstChunk[i])*PKD_CONTAINER_CHECKSUM_CHUNK;
+            chunkHash[c] = checksumChunkOf(sections[i].data+begin,
+                                           std::min(sections[i].size-begin,
+                                                    PKD_CONTAINER_CHECKSUM_CHUNK));
+          });
+        for (size_t i=0;i<sections.size();i++) {
+          uint64_t hash = checksumChunkOf(NULL,0);
+          for (size_t c=firstChunk[i];c<firstChunk[i+1];c++)
+            hash = foldChecksum(hash,chunkHash[c]);
+          if (hash != sections[i].checksum)
+            throw std::runtime_error("corrupt pkd container (checksum mismatch in section "
+                                     +std::to_string(i)+", '"+sections[i].name+"')");
+        }
+      }
+      return sections;
+    }
+
+    /*! writes a container, one section at a time; the header and
+        section table get written by close() */
+    class ContainerWriter {
+    public:
+      ContainerWriter(const std::string &fileName)
+        : fileName(fileName), file(fopen(fileName.c_str(),"wb"))
+      {
+        if (!file)
+          throw std::runtime_error("could not open '"+fileName+"' for writing");
+        // the header gets filled in by close()
+        ContainerHeader header;
+        memset(&header,0,sizeof(header));
+        write(&header,sizeof(header));
+      }
+      ~ContainerWriter() { if (file) fclose(file); }
+
+      /*! append a section, whose 'size' bytes of data get copied from
+          'src' (at 'srcOfs'); a NULL 'src' means no data */
+      void addSection(const std::string &name, const Properties &props,
+                      FILE *src=NULL, const size_t srcOfs=0, const size_t size=0)
+      {
+        if (name.size() >= PKD_CONTAINER_MAX_NAME)
+          throw std::runtime_error("pkd container section name '"+name+"' too long");
+        ContainerSectionEntry entry;
+        memset(&entry,0,sizeof(entry));
+        strcpy(entry.name,name.c_str());
+        entry.ofs  = pad();
+        entry.size = size;
+        uint64_t hash = checksumChunkOf(NULL,0);
+        if (size) {
+          if (fseek(src,srcOfs,SEEK_SET) != 0)
+            throw std::runtime_error("could not read the data of section '"+name+"'");
+          std::vector<unsigned char> chunk(PKD_CONTAINER_CHECKSUM_CHUNK);
+          for (size_t done=0;done<size;) {
+            const size_t n = std::min(size-done,chunk.size());
+            if (fread(&chunk[0],1,n,src) != n)
+              throw std::runtime_error("could not read the data of section '"+name+"'");
+            write(&chunk[0],n);
+            hash = foldChecksum(hash,checksumChunkOf(&chunk[0],n));
+            done += n;
+          }
+        }
+        entry.checksum = hash;
+        entry.propsOfs = props.size() ? propData.size() : 0;
+        for (Properties::const_iterator it=props.begin();it!=props.end();++it) {
+          propData.insert(propData.end(),it->first.begin(),it->first.end());
+          propData.push_back(0);
+          propData.insert(propData.end(),it->second.begin(),it->second.end());
+          propData.push_back(0);
+        }
+        entry.propsSize = propData.size()-entry.propsOfs;
+        entries.push_back(entry);
+      }
+
+      //! write the section table and the header
+      void close()
+      {
+        std::vector<unsigned char> table(entries.size()*sizeof(ContainerSectionEntry));
+        if (!entries.empty())
+          memcpy(&table[0],&entries[0],table.size());
+        table.insert(table.end(),propData.begin(),propData.end());
+
+        ContainerHeader header;
+        memset(&header,0,sizeof(header));
+        memcpy(header.magic,containerMagic,sizeof(containerMagic));
+        header.version       = PKD_CONTAINER_VERSION;
+        header.numSections   = entries.size();
+        header.alignment     = PKD_CONTAINER_ALIGNMENT;
+        header.tableOfs      = pad();
+        header.tableSize     = table.size();
+        header.tableChecksum = checksumOf(table.data(),table.size());
+        write(table.data(),table.size());
+        header.fileSize      = ftell(file);
+        fseek(file,0,SEEK_SET);
+        write(&header,sizeof(header));
+        if (fclose(file) != 0) {
+          file = NULL;
+          throw std::runtime_error("could not write '"+fileName+"'");
+        }
+        file = NULL;
+      }
+
+    private:
+      void write(const void *data, const size_t size)
+      {
+        if (size && fwrite(data,1,size,file) != size)
+          throw std::runtime_error("could not write '"+fileName+"'");
+      }
+      //! pad the file to the next aligned offset, and return that
+      size_t pad()
+      {
+        static const unsigned char zero[PKD_CONTAINER_ALIGNMENT] = { 0 };
+        const size_t ofs = ftell(file);
+        write(zero,(PKD_CONTAINER_ALIGNMENT-ofs%PKD_CONTAINER_ALIGNMENT)%PKD_CONTAINER_ALIGNMENT);
+        return ftell(file);
+      }
+
+      const std::string fileName;
+      FILE *file;
+      std::vector<ContainerSectionEntry> entries;
+      std::vector<char> propData;
+    };
+
+    /*! the sections of an xml .pkd file's <PKDGeometry> element: one
+        per child element, with its properties (except for the offsets
+        into the .pkdbin, which 'bin' - if not NULL - points to), and
+        an element's content as its "value". a range tree's bin edges
+        become a section of their own, "binEdges" */
+    inline std::vector<Section> sectionsOfXML(const ospcommon::xml::Node &pkdNode,
+                                              unsigned char *bin)
+    {
+      std::vector<Section> sections;
+      for (const ospcommon::xml::Node &e : pkdNode.child) {
+        Section s;
+        s.name  = e.name;
+        s.props = e.properties;
+        s.props.erase("ofs");
+        s.props.erase("edgesOfs");
+        s.props.erase("edgesCount");
+        if (e.content != "")
+          s.props["value"] = e.content;
+        if (e.getProp("ofs") != "") {
+          s.ofs = sizeOfProp(e.getProp("ofs"),"ofs",e.name);
+          const uint64_t count = s.count();
+          const size_t formatSize = formatSizeOf(e.getProp("format"));
+          if (count > SIZE_MAX/formatSize)
+            throw std::runtime_error("invalid count in section '"+e.name+"'");
+          s.size = count*formatSize;
+          s.data = bin ? bin+s.ofs : NULL;
+        }
+        sections.push_back(s);
+        if (e.getProp("edgesOfs") != "") {
+          Section edges;
+          edges.name = "binEdges";
+          edges.props["attribute"] = e.getProp("attribute");
+          edges.props["count"]     = e.getProp("edgesCount");
+          edges.props["format"]    = "float";
+          edges.ofs = sizeOfProp(e.getProp("edgesOfs"),"edgesOfs",e.name);
+          const uint64_t count = sizeOfProp(e.getProp("edgesCount"),"edgesCount",e.name);
+          if (count > SIZE_MAX/sizeof(float))
+            throw std::runtime_error("invalid edgesCount in section '"+e.name+"'");
+          edges.size = count*sizeof(float);
+          edges.data = bin ? bin+edges.ofs : NULL;
+          sections.push_back(edges);
+        }
+      }
+      return sections;
+    }
+
+    /*! convert an xml .pkd (plus .pkdbin) pair into a container; the
+        .pkdbin gets read one chunk at a time, so this works for files
+        larger than memory, too */
+    inline void convertToContainer(const std::string &xmlFileName,
+                                   const std::string &containerFileName)
+    {
+      std::shared_ptr<ospcommon::xml::XMLDoc> doc = ospcommon::xml::readXML(xmlFileName);
+      if (!doc || doc->child.empty() || doc->child[0].child.empty()
+          || doc->child[0].child[0].name != "PKDGeometry")
+        throw std::runtime_error("failed to find PKDGeometry node in '"+xmlFileName+"'");
+      const std::vector<Section> sections = sectionsOfXML(doc->child[0].child[0],NULL);
+
+      const std::string binFileName = xmlFileName+"bin";
+      FILE *bin = fopen(binFileName.c_str(),"rb");
+      if (!bin)
+        throw std::runtime_error("could not open '"+binFileName+"'");
+      try {
+        ContainerWriter writer(containerFileName);
+        for (size_t i=0;i<sections.size();i++)
+          writer.addSection(sections[i].name,sections[i].props,
+                            bin,sections[i].ofs,sections[i].size);
+        writer.close();
+      } catch (...) {
+        fclose(bin);
+        throw;
+      }
+      fclose(bin);
+    }
+
+  }
+}
@@ -0,0 +1,112 @@
+// ======================================================================== //
+// Copyright 2009-2014 Intel Corporation                                    //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "PKDFile.h"
+#include "PKDMemory.h"
+#include "PKDSections.h"
+// ospray
+#include "ospray/common/OSPCommon.h"
+// std
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+
+namespace ospray {
+  namespace pkd {
+
+    //! sets the parameters straight on the geometry, as shared (not copied) data
+    struct GeometryParamSink : public ParamSink {
+      GeometryParamSink(OSPGeometry geom) : geom(geom) {}
+
+      virtual void setData(const std::string &name, const OSPDataType type, const Section &s)
+      {
+        OSPData data = ospNewData(s.count(),type,s.data,OSP_DATA_SHARED_BUFFER);
+        ospSetData(geom,name.c_str(),data);
+        // the geometry keeps its own reference
+        ospRelease(data);
+      }
+      virtual void set1i(const std::string &name, const int v)
+      { ospSet1i(geom,name.c_str(),v); }
+      virtual void set1f(const std::string &name, const float v)
+      { ospSet1f(geom,name.c_str(),v); }
+      virtual void set2f(const std::string &name, const vec2f &v)
+      { ospSet2f(geom,name.c_str(),v.x,v.y); }
+      virtual void set3f(const std::string &name, const vec3f &v)
+      { ospSet3f(geom,name.c_str(),v.x,v.y,v.z); }
+
+      OSPGeometry geom;
+    };
+
+  }
+}
+
+extern "C" OSPRAY_DLLEXPORT OSPGeometry ospNewPKDGeometryFromFile(const char *fileName)
+{
+  using namespace ospray;
+  try {
+    const double t0 = ospcommon::getSysTime();
+    const bool container = pkd::isContainer(fileName);
+    const std::string dataFileName = container ? std::string(fileName) : std::string(fileName)+"bin";
+    const pkd::LoadOptions loadOptions = pkd::LoadOptions::fromEnvironment();
+    size_t size = 0;
+    unsigned char *base = loadOptions.any()
+      ? pkd::loadFile(dataFileName,loadOptions,size)
+      : pkd::mapFile(dataFileName,size);
+
+    // until the geometry takes it over, see below
+    std::unique_ptr<pkd::FileMemory> memory(new pkd::FileMemory(base,size,loadOptions));
+
+    std::vector<pkd::Section> sections;
+    OSPGeometry geom = NULL;
+    try {
+      if (container) {
+        const char *verify = getenv("OSPRAY_PKD_VERIFY");
+        sections = pkd::readContainer(base,size,verify && atoi(verify));
+      } else {
+        std::shared_ptr<ospcommon::xml::XMLDoc> doc = ospcommon::xml::readXML(fileName);
+        if (!doc || doc->child.empty() || doc->child[0].child.empty()
+            || doc->child[0].child[0].name != "PKDGeometry")
+          throw std::runtime_error("failed to find PKDGeometry node");
+        sections = pkd::sectionsOfXML(doc->child[0].child[0],base);
+        for (const pkd::Section &s : sections)
+          if (s.ofs > size || s.size > size-s.ofs)
+            throw std::runtime_error("section '"+s.name+"' past the end of '"+dataFileName+"'");
+      }
+
+      geom = ospNewGeometry("pkd_geometry");
+      if (!geom)
+        throw std::runtime_error("could not create a pkd_geometry");
+      // the file's memory now lives (and dies) with the geometry
+      ospSetVoidPtr(geom,"fileMemory",memory.release());
+      pkd::GeometryParamSink sink(geom);
+      pkd::paramsOfSections(sections,sink);
+      ospCommit(geom);
+    } catch (...) {
+      // the file's memory goes with the geometry, or with 'memory' if
+      // the geometry never got it
+      if (geom)
+        ospRelease(geom);
+      throw;
+    }
+    std::cout << "#osp:pkd: " << (container ? "mapped container " : "mapped ")
+              << dataFileName << " (" << (size>>20) << " MB, " << sections.size()
+              << " sections) in " << (ospcommon::getSysTime()-t0) << " sec" << std::endl;
+    return geom;
+  } catch (const std::exception &e) {
+    std::cout << "#osp:pkd: could not load '" << fileName << "': " << e.what() << std::endl;
+    return NULL;
+  }
+}
@@ -0,0 +1,39 @@
+// ======================================================================== //
+// Copyright 2009-2014 Intel Corporation                                    //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+/*! \file PKDFile.h loading a .pkd file straight into a pkd geometry,
+    without going through the scene graph: the file (a container, or
+    the .pkdbin of an xml .pkd) gets mapped, and every section of it
+    becomes shared (never copied) data of the geometry. with the
+    bounds, range trees, etc. the builder stores in the file, the
+    geometry doesn't have to scan any of it either, so the time to
+    the first frame is that of the page faults the first frame
+    takes */
+
+#include "ospray/ospray.h"
+
+/*! create (and commit) a "pkd_geometry" for the given .pkd file; a
+    transfer function (for files with attributes) can be set, and the
+    geometry re-committed, before adding it to a model. returns NULL
+    (after printing why) if the file can't be loaded. the file stays
+    mapped for as long as the geometry lives (its "fileMemory"
+    parameter, see PKDMemory.h). the sections map to parameters as in
+    PKDSections.h. loading honors
+    OSPRAY_PKD_HUGE_PAGES/OSPRAY_PKD_NUMA (PKDMemory.h), and
+    OSPRAY_PKD_VERIFY (PKDContainer.h) */
+extern "C" OSPRAY_DLLEXPORT OSPGeometry ospNewPKDGeometryFromFile(const char *fileName);
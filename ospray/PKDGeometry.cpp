@@ -15,7 +15,9 @@
 // ======================================================================== //
 
 #include "PKDGeometry.h"
+#include "PKDBounds.h"
 #include "PKDConfig.h"
+#include "PKDMemory.h"
 // ospray
 #include "ospray/common/Model.h"
 #include "ospray/common/OSPCommon.h"
@@ -26,25 +28,31 @@ namespace ospray {
 
   //! Constructor
   PartiKDGeometry::PartiKDGeometry()
-    : particleRadius(.02f)
+    : activeAttribute(0),
+      numBins(32),
+      binningType(pkd::BINNING_LINEAR),
+      binningRequested(false),
+      attribute(NULL),
+      particleRadius(.02f),
+      lodTreeSource(NULL),
+      wideArity(0),
+      wideNodesSource(NULL)
   {
     ispcEquivalent = ispc::PartiKDGeometry_create(this);
   }
 
-    vec3f decodeParticle(size_t i) {
-      size_t mask = (1<<20)-1;
-      size_t ix = (i>> 2)&mask;
-      size_t iy = (i>>22)&mask;
-      size_t iz = (i>>42)&mask;
-      return vec3f(ix,iy,iz);
-    }
+  PartiKDGeometry::~PartiKDGeometry()
+  {
+    // the file our (shared) data lives in; whoever else still holds
+    // on to that data is out of luck, just like with any shared buffer
+    delete (pkd::FileMemory *)getVoidPtr("fileMemory",NULL);
+  }
 
-  
   vec3f PartiKDGeometry::getParticle(size_t i) const 
   {
     switch(format) {
     case OSP_FLOAT3: return particle3f[i];
-    case OSP_ULONG: return decodeParticle(particle1ul[i]);
+    case OSP_ULONG: return quantization.decode(particle1ul[i]);
     default: NOTIMPLEMENTED;
     };
   }
@@ -53,18 +61,24 @@ namespace ospray {
   /*! return bounding box of particle centers */
   box3f PartiKDGeometry::getBounds() const
   {
-    box3f b = empty;
-    for (size_t i=0;i<numParticles;i++) {
-      b.extend(getParticle(i));
+    switch(format) {
+    case OSP_FLOAT3: return pkd::computeBounds((const float *)particle3f,numParticles);
+    case OSP_ULONG:
+      return quantization.decode(pkd::computeBounds((const uint64_t *)particle1ul,numParticles));
+    case OSP_UINT: {
+      // (relatively quantized) particles are inside their frames
+      box3f bounds = empty;
+      const pkd::QuantizationFrame *frame
+        = (const pkd::QuantizationFrame *)quantizationFrameData->data;
+      const float maxCoord = float((1<<pkd::RELATIVE_POSITION_BITS)-1);
+      for (size_t i=0;i<quantizationFrameData->numItems/2;i++) {
+        bounds.extend(frame[i].origin);
+        bounds.extend(frame[i].origin+maxCoord*frame[i].scale);
+      }
+      return bounds;
     }
-    return b;
-  }
-
-  uint32 getAttributeBits(float val, float lo, float hi)
-  {
-    if (hi == lo) return 1;
-    int bit = std::min((int)31,int(32*((val-lo)/float(hi-lo))));
-    return 1<<bit;
+    default: NOTIMPLEMENTED;
+    };
   }
 
   /*! gets called whenever any of this node's dependencies got changed */
@@ -74,6 +88,109 @@ namespace ospray {
   }
 
 
+  const float *PartiKDGeometry::valuesOf(const Attribute &attr, std::vector<float> &decoded) const
+  {
+    if (!attr.isQuantized)
+      return (const float*)attr.data->data;
+    decoded.resize(attr.data->numItems);
+    const pkd::AttributeQuantization &q = attr.quantization;
+    if (q.bits == 8) {
+      const uint8 *value = (const uint8*)attr.data->data;
+      tasking::parallel_for(decoded.size(),[&](size_t i){ decoded[i] = q.decode(value[i]); });
+    } else {
+      const uint16 *value = (const uint16*)attr.data->data;
+      tasking::parallel_for(decoded.size(),[&](size_t i){ decoded[i] = q.decode(value[i]); });
+    }
+    return &decoded[0];
+  }
+
+  const uint32 *PartiKDGeometry::getRangeTree(Attribute &attr, const size_t numInnerNodes)
+  {
+    if (attr.rangeTreeData && !binningRequested && attr.rangeTreeData->type == OSP_UINT
+        && attr.rangeTreeData->numItems % numInnerNodes == 0) {
+      // precomputed by the builder; use it as is. the number of bins
+      // follows from its size, the kind of binning from whether it
+      // comes with bin edges
+      const int fileBins = int(32*(attr.rangeTreeData->numItems / numInnerNodes));
+      const Data *edges = attr.binEdgesData.ptr;
+      if (fileBins <= pkd::RANGE_TREE_MAX_BINS &&
+          (!edges || (edges->type == OSP_FLOAT && edges->numItems == fileBins+1))) {
+        attr.binning.numBins = fileBins;
+        if (edges)
+          attr.binning.edges.assign((const float*)edges->data,
+                                    (const float*)edges->data+fileBins+1);
+        else
+          attr.binning.edges.clear();
+        return (const uint32*)attr.rangeTreeData->data;
+      }
+      postStatusMsg() << "#osp:pkd: Warning - ignoring invalid range tree from file";
+    }
+    if (attr.rangeTreeSource == attr.data->data
+        && attr.binning.numBins == numBins && attr.binningType == binningType
+        && attr.rangeTree.size() == numInnerNodes*attr.binning.numWords()) {
+      // computed on an earlier commit
+      return &attr.rangeTree[0];
+    }
+
+    std::vector<float> decoded;
+    const float *value = valuesOf(attr,decoded);
+    attr.binning = pkd::computeBinning(value,numParticles,numBins,binningType);
+    attr.binningType = binningType;
+    attr.rangeTree.resize(numInnerNodes*attr.binning.numWords());
+    postStatusMsg(2) << "#osp:pkd: computing range tree (" << numBins << " "
+      << pkd::nameOf(binningType) << " bins), "
+      << attr.rangeTree.size() * sizeof(uint32) << " bytes";
+    pkd::computeRangeTree(value,(const uint64_t*)&treeletBegin[0],treeletBounds.size(),
+                          attr.binning,&attr.rangeTree[0],blockLevels);
+    attr.rangeTreeSource = attr.data->data;
+    return &attr.rangeTree[0];
+  }
+
+  const uint32 *PartiKDGeometry::getMinMaxTree(Attribute &attr, const size_t numInnerNodes)
+  {
+    if (attr.minMaxTreeData && attr.rangeTreeData && !binningRequested
+        && attr.minMaxTreeData->type == OSP_UINT
+        && attr.minMaxTreeData->numItems == numInnerNodes) {
+      // precomputed by the builder, relative to the file's attribute range
+      return (const uint32*)attr.minMaxTreeData->data;
+    }
+    if (attr.minMaxTreeSource == attr.data->data && attr.minMaxTree.size() == numInnerNodes) {
+      // computed on an earlier commit
+      return &attr.minMaxTree[0];
+    }
+
+    attr.minMaxTree.resize(numInnerNodes);
+    postStatusMsg(2) << "#osp:pkd: computing min/max tree, "
+      << numInnerNodes * sizeof(uint32) << " bytes";
+    std::vector<float> decoded;
+    pkd::computeMinMaxTree(valuesOf(attr,decoded),
+                           (const uint64_t*)&treeletBegin[0],treeletBounds.size(),
+                           attr.binning.lo,attr.binning.hi,&attr.minMaxTree[0],blockLevels);
+    attr.minMaxTreeSource = attr.data->data;
+    return &attr.minMaxTree[0];
+  }
+
+  const float *PartiKDGeometry::getLODMean(Attribute &attr, const size_t numInnerNodes)
+  {
+    if (attr.lodMeanData && attr.lodMeanData->type == OSP_FLOAT
+        && attr.lodMeanData->numItems == numInnerNodes)
+      // precomputed by the builder
+      return (const float*)attr.lodMeanData->data;
+    if (attr.lodMeanSource == attr.data->data && attr.lodMean.size() == numInnerNodes)
+      // computed on an earlier commit
+      return &attr.lodMean[0];
+
+    attr.lodMean.resize(numInnerNodes);
+    postStatusMsg(2) << "#osp:pkd: computing lod means, "
+      << numInnerNodes * sizeof(float) << " bytes";
+    std::vector<float> decoded;
+    pkd::computeLODMean(valuesOf(attr,decoded),
+                        (const uint64_t*)&treeletBegin[0],treeletBounds.size(),
+                        &attr.lodMean[0],blockLevels);
+    attr.lodMeanSource = attr.data->data;
+    return &attr.lodMean[0];
+  }
+
   /*! \brief integrates this geometry's primitives into the respective
     model's acceleration structure */
   void PartiKDGeometry::finalize(Model *model) 
@@ -83,7 +200,8 @@ namespace ospray {
     // parse parameters, using hard assertions (exceptions) for now.
     //
     // note:
-    // - "float radius" *MUST* be defined with the object
+    // - "float radius" *MUST* be defined with the object (unless
+    //   "data<float> particleRadius" gives per-particle radii)
     // - "data<vec3f> particles' *MUST* be defined for the object
     // -------------------------------------------------------
     particleData = getParamData("position");
@@ -93,10 +211,128 @@ namespace ospray {
     particle     = particleData->data;
     numParticles = particleData->numItems;
     format = particleData->type;
+    if (format != OSP_FLOAT3 && format != OSP_ULONG && format != OSP_UINT)
+      throw std::runtime_error("#osp:pkd: 'position' has to be float3, ulong, or uint data");
     const bool isQuantized = format == OSP_ULONG;
-    const box3f centerBounds = getBounds();
+    quantization = isQuantized
+      ? pkd::PositionQuantization(getParam3f("quantization.origin",vec3f(0.f)),
+                                  getParam3f("quantization.scale",vec3f(1.f)))
+      : pkd::PositionQuantization();
+    quantizationFrameData   = getParamData("quantizationFrames",NULL);
+    quantizationFrameLevels = getParam1i("quantizationFrameLevels",0);
+    if (format == OSP_UINT &&
+        (!quantizationFrameData || quantizationFrameData->type != OSP_FLOAT3 ||
+         quantizationFrameLevels < 1 || quantizationFrameLevels > PKD_MAX_BLOCK_LEVELS))
+      throw std::runtime_error("#osp:pkd: uint particles need 'quantizationFrames' "
+                               "and 'quantizationFrameLevels' (in [1..16])");
+
+    // treelets: either given (with their bounds) by the file, or one
+    // treelet covering all particles
+    treeletBeginData  = getParamData("treeletBegin",NULL);
+    treeletBoundsData = getParamData("treeletBounds",NULL);
+    treeletBegin.clear();
+    treeletBounds.clear();
+    box3f centerBounds = empty;
+    if (treeletBeginData && treeletBoundsData) {
+      const size_t numTreelets = treeletBeginData->numItems-1;
+      if (treeletBeginData->type != OSP_ULONG || treeletBoundsData->type != OSP_FLOAT3
+          || treeletBoundsData->numItems != 2*numTreelets)
+        throw std::runtime_error("#osp:pkd: invalid 'treeletBegin'/'treeletBounds' data");
+      const uint64 *begin = (const uint64 *)treeletBeginData->data;
+      const box3f  *bounds = (const box3f *)treeletBoundsData->data;
+      if (begin[0] != 0 || begin[numTreelets] != numParticles)
+        throw std::runtime_error("#osp:pkd: treelets do not cover all particles");
+      treeletBegin.assign(begin,begin+numTreelets+1);
+      treeletBounds.assign(bounds,bounds+numTreelets);
+      for (size_t i=0;i<numTreelets;i++)
+        centerBounds.extend(treeletBounds[i]);
+    } else {
+      // bounds the file (or the app) already knows about save us
+      // from scanning all particles
+      const float inf = std::numeric_limits<float>::infinity();
+      const vec3f cachedLower = getParam3f("centerBounds.lower",vec3f(+inf));
+      const vec3f cachedUpper = getParam3f("centerBounds.upper",vec3f(-inf));
+      if (cachedLower.x <= cachedUpper.x &&
+          cachedLower.y <= cachedUpper.y &&
+          cachedLower.z <= cachedUpper.z)
+        centerBounds = box3f(cachedLower,cachedUpper);
+      else
+        centerBounds = getBounds();
+      treeletBegin.push_back(0);
+      treeletBegin.push_back(numParticles);
+      treeletBounds.push_back(centerBounds);
+    }
+    const size_t numTreelets = treeletBounds.size();
+    treeletFrameBegin.clear();
+    if (format == OSP_UINT) {
+      treeletFrameBegin.push_back(0);
+      for (size_t i=0;i<numTreelets;i++)
+        treeletFrameBegin.push_back(treeletFrameBegin.back()
+                                    +pkd::numFramesOf(treeletBegin[i+1]-treeletBegin[i],
+                                                      quantizationFrameLevels));
+      if (quantizationFrameData->numItems != 2*treeletFrameBegin.back())
+        throw std::runtime_error("#osp:pkd: 'quantizationFrames' does not match the tree");
+    }
+    treeletMaskBegin.resize(numTreelets);
+    size_t numInnerNodes = 0;
+    for (size_t i=0;i<numTreelets;i++) {
+      treeletMaskBegin[i] = numInnerNodes;
+      numInnerNodes += (treeletBegin[i+1]-treeletBegin[i])/2;
+    }
+
+    // the particles within each treelet are either in plain level
+    // order, or in blocks of "blockLevels" tree levels (PKDLayout.h)
+    blockLevels = getParam1i("blockLevels",0);
+    if (blockLevels < 0 || blockLevels > PKD_MAX_BLOCK_LEVELS)
+      throw std::runtime_error("#osp:pkd: invalid blockLevels (has to be in [0..16])");
     
-    attributeData = getParamData("attribute",NULL);
+    // attributes: "attribute.<i>" (with optional "attributeRangeTree.<i>"
+    // and "attributeRange.<i>"), or a single "attribute"
+    size_t numAttributes = 0;
+    while (getParamData(("attribute."+std::to_string(numAttributes)).c_str(),NULL))
+      ++numAttributes;
+    const bool singleAttribute = numAttributes == 0 && getParamData("attribute",NULL);
+    if (singleAttribute)
+      numAttributes = 1;
+    attributes.resize(numAttributes);
+    for (size_t i=0;i<numAttributes;i++) {
+      const std::string suffix = singleAttribute ? "" : "."+std::to_string(i);
+      Attribute &attr = attributes[i];
+      attr.data = getParamData(("attribute"+suffix).c_str(),NULL);
+      attr.rangeTreeData = getParamData(("attributeRangeTree"+suffix).c_str(),NULL);
+      attr.binEdgesData  = getParamData(("attributeBinEdges"+suffix).c_str(),NULL);
+      attr.minMaxTreeData = getParamData(("attributeMinMaxTree"+suffix).c_str(),NULL);
+      attr.lodMeanData = getParamData(("attributeLODMean"+suffix).c_str(),NULL);
+      if (attr.rangeTreeData) {
+        const vec2f range = getParam2f(("attributeRange"+suffix).c_str(),vec2f(0.f));
+        attr.binning.lo = range.x;
+        attr.binning.hi = range.y;
+      }
+      if (attr.data->numItems != numParticles)
+        throw std::runtime_error("#osp:pkd: attribute"+suffix+" has the wrong number of items");
+      attr.isQuantized = attr.data->type == OSP_UCHAR || attr.data->type == OSP_USHORT;
+      if (attr.isQuantized) {
+        const vec2f range = getParam2f(("attributeQuantizedRange"+suffix).c_str(),vec2f(0.f,1.f));
+        attr.quantization = pkd::AttributeQuantization(attr.data->type == OSP_UCHAR ? 8 : 16,
+                                                       range.x,range.y);
+      }
+    }
+    activeAttribute = getParam1i("activeAttribute",0);
+    binningRequested = findParam("attributeBins") || findParam("attributeBinning");
+    numBins = getParam1i("attributeBins",32);
+    binningType = pkd::binningTypeOf(getParamString("attributeBinning","linear"));
+    if (numBins <= 0 || numBins > pkd::RANGE_TREE_MAX_BINS || numBins % 32)
+      throw std::runtime_error("#osp:pkd: invalid attributeBins (has to be 32, 64, 96, or 128)");
+    const float opacityThreshold = getParamf("opacityThreshold",.5f);
+    // only particles with attributes in [clipRange.x,clipRange.y]
+    const bool clipRequested = findParam("attributeClipRange");
+    const vec2f clipRange = getParam2f("attributeClipRange",vec2f(0.f));
+    if (numAttributes > 0 && (activeAttribute < 0 || activeAttribute >= numAttributes)) {
+      postStatusMsg() << "#osp:pkd: Warning - invalid activeAttribute " << activeAttribute
+                      << ", using attribute 0";
+      activeAttribute = 0;
+    }
+
     transferFunction = (TransferFunction*)getParamObject("transferFunction",NULL);
     if (transferFunction) {
       transferFunction->registerListener(this);
@@ -105,8 +341,46 @@ namespace ospray {
     }
 
     bool useSPMD = getParam1i("useSPMD",0);
+    // stream traversal shares the upper "streamDepth" levels of the
+    // tree among all packets of a ray stream
+    const bool useStream = getParam1i("useStream",0);
+    const int streamDepth = getParam1i("streamDepth",PKD_DEFAULT_STREAM_DEPTH);
+    if (streamDepth < 0 || streamDepth > PKD_MAX_STREAM_DEPTH)
+      throw std::runtime_error("#osp:pkd: invalid streamDepth (has to be in [0.."
+                               +std::to_string(PKD_MAX_STREAM_DEPTH)+"])");
 
-    particleRadius = getParamf("radius",0.f);
+    // per-particle radii: every inner node's slab gets widened by the
+    // largest radius in its subtree, rather than by the largest one
+    // overall
+    radiusData = getParamData("particleRadius",NULL);
+    const float *maxRadiusArray = NULL;
+    if (radiusData) {
+      if (radiusData->type != OSP_FLOAT || radiusData->numItems != numParticles)
+        throw std::runtime_error("#osp:pkd: 'particleRadius' has to be one float per particle");
+      const float *radius = (const float *)radiusData->data;
+      maxRadiusTreeData = getParamData("maxRadiusTree",NULL);
+      maxRadiusTree.clear();
+      if (maxRadiusTreeData) {
+        if (maxRadiusTreeData->type != OSP_FLOAT || maxRadiusTreeData->numItems != numInnerNodes)
+          throw std::runtime_error("#osp:pkd: 'maxRadiusTree' has to be one float per inner node");
+        maxRadiusArray = (const float *)maxRadiusTreeData->data;
+      } else if (numInnerNodes) {
+        maxRadiusTree.resize(numInnerNodes);
+        pkd::computeMaxRadiusTree(radius,(const uint64_t*)&treeletBegin[0],numTreelets,
+                                  &maxRadiusTree[0],blockLevels);
+        maxRadiusArray = &maxRadiusTree[0];
+      }
+      // the largest radius is that of (any) treelet's root
+      particleRadius = 0.f;
+      for (size_t i=0;i<numTreelets;i++) {
+        const size_t size = treeletBegin[i+1]-treeletBegin[i];
+        if (size > 1)
+          particleRadius = std::max(particleRadius,maxRadiusArray[treeletMaskBegin[i]]);
+        else if (size == 1)
+          particleRadius = std::max(particleRadius,radius[treeletBegin[i]]);
+      }
+    } else
+      particleRadius = getParamf("radius",0.f);
     if (particleRadius <= 0.f)
       throw std::runtime_error("#osp:pkd: invalid radius (<= 0.f)");
     const float expectedRadius
@@ -115,51 +389,146 @@ namespace ospray {
       postStatusMsg() << "#osp:pkd: Warning - particle radius is pretty big for given particle configuration !?";
     }
     
+    // level of detail: a subtree whose proxy sphere (radius of
+    // gyration plus largest particle radius) covers less than
+    // "lodPixelThreshold" pixels, each "lodPixelAngle" radians wide,
+    // gets intersected as that sphere. 0 (the default) turns it off
+    const float lodPixelThreshold = getParamf("lodPixelThreshold",0.f);
+    const float lodPixelAngle = getParamf("lodPixelAngle",PKD_DEFAULT_LOD_PIXEL_ANGLE);
+    if (lodPixelThreshold < 0.f || lodPixelAngle <= 0.f)
+      throw std::runtime_error("#osp:pkd: invalid lodPixelThreshold/lodPixelAngle");
+    float lodScale = lodPixelThreshold*lodPixelAngle;
+    const pkd::LODAggregate *lodArray = NULL;
+    lodTreeData = getParamData("lodTree",NULL);
+    if (lodScale > 0.f && numInnerNodes > 0) {
+      if (lodTreeData) {
+        if (lodTreeData->type != OSP_FLOAT || lodTreeData->numItems != 5*numInnerNodes)
+          throw std::runtime_error("#osp:pkd: 'lodTree' has to be five floats per inner node");
+        lodArray = (const pkd::LODAggregate *)lodTreeData->data;
+      } else if (lodTreeSource == particle && lodTree.size() == numInnerNodes) {
+        // computed on an earlier commit
+        lodArray = &lodTree[0];
+      } else if (format != OSP_UINT) {
+        lodTree.resize(numInnerNodes);
+        postStatusMsg(2) << "#osp:pkd: computing lod tree, "
+          << numInnerNodes * sizeof(pkd::LODAggregate) << " bytes";
+        pkd::computeLODTree([&](size_t i){ return getParticle(i); },
+                            (const uint64_t*)&treeletBegin[0],numTreelets,
+                            &lodTree[0],blockLevels);
+        lodTreeSource = particle;
+        lodArray = &lodTree[0];
+      } else {
+        postStatusMsg() << "#osp:pkd: Warning - relatively quantized particles need "
+                        << "a 'lodTree' from the file (ospPartiKD --lod), disabling lod";
+        lodScale = 0.f;
+      }
+    }
+
+    // k-ary traversal, over wide nodes of 2 (4-ary) or 3 (8-ary)
+    // binary tree levels each
+    wideArity = getParam1i("wideArity",0);
+    if (wideArity != 0 && wideArity != 4 && wideArity != 8)
+      throw std::runtime_error("#osp:pkd: invalid wideArity (has to be 0, 4, or 8)");
+    const int wideLevels = wideArity ? pkd::wideLevelsOf(wideArity) : 0;
+    const float *wideArray = NULL;
+    wideNodeData = getParamData("wideNodes",NULL);
+    treeletWideBegin.clear();
+    if (wideLevels) {
+      treeletWideBegin.push_back(0);
+      for (size_t i=0;i<numTreelets;i++)
+        treeletWideBegin.push_back(treeletWideBegin.back()
+                                   +pkd::numWideNodesOf(treeletBegin[i+1]-treeletBegin[i],
+                                                        wideLevels));
+      const size_t numWideFloats = treeletWideBegin.back()*pkd::wideNodeFloatsOf(wideLevels);
+      if (wideNodeData) {
+        if (wideNodeData->type != OSP_FLOAT || wideNodeData->numItems != numWideFloats)
+          throw std::runtime_error("#osp:pkd: 'wideNodes' do not match the tree and wideArity");
+        wideArray = (const float *)wideNodeData->data;
+      } else if (wideNodesSource == particle && wideNodes.size() == numWideFloats) {
+        // computed on an earlier commit
+        wideArray = &wideNodes[0];
+      } else if (format != OSP_UINT) {
+        wideNodes.resize(numWideFloats);
+        postStatusMsg(2) << "#osp:pkd: computing " << wideArity << "-ary wide nodes, "
+          << numWideFloats * sizeof(float) << " bytes";
+        pkd::computeWideNodes([&](size_t i){ return getParticle(i); },
+                              [&](size_t i){
+                                if (format == OSP_ULONG) return int(particle1ul[i] & 3);
+                                vec3f p = particle3f[i];
+                                return ((int&)p.x) & 3;
+                              },
+                              (const uint64_t*)&treeletBegin[0],numTreelets,
+                              wideLevels,&wideNodes[0],blockLevels);
+        wideNodesSource = particle;
+        wideArray = &wideNodes[0];
+      } else {
+        postStatusMsg() << "#osp:pkd: Warning - relatively quantized particles need "
+                        << "'wideNodes' from the file (ospPartiKD --wide), using binary traversal";
+      }
+    }
+
     const box3f sphereBounds(centerBounds.lower - vec3f(particleRadius),
                              centerBounds.upper + vec3f(particleRadius));
-    size_t numInnerNodes = numParticles/2;
 
 
     // compute attribute mask and attrib lo/hi values
     float attr_lo = 0.f, attr_hi = 0.f;
-    // TODO will: binBitsArray is leaked on commits
-    uint32 *binBitsArray = NULL;
-    attribute = (float*)(attributeData?attributeData->data:NULL);
-
-    if (numParticles >= (1ULL << 31)) {
-      throw std::runtime_error("PKD Error: Too many particles in this geometry, "
-                               "split this model up into multiple PKD treelets.");
+    const uint32 *binBitsArray = NULL;
+    int activeBins = 32;
+    activeBinEdges.clear();
+    const uint32 *minMaxArray = NULL;
+    const float *lodMeanArray = NULL;
+    bool clipAttribute = false;
+    int32 clipQLo = 0, clipQHi = 0;
+    attribute = numAttributes ? attributes[activeAttribute].data->data : NULL;
+    // quantized attributes decode to attributeQLo + q*attributeQScale
+    int32 attributeBytes = 4;
+    float attributeQLo = 0.f, attributeQScale = 1.f;
+    if (numAttributes && attributes[activeAttribute].isQuantized) {
+      const pkd::AttributeQuantization &q = attributes[activeAttribute].quantization;
+      attributeBytes  = q.bits/8;
+      attributeQLo    = q.lo;
+      attributeQScale = q.scale();
     }
 
+    if (numParticles > (1ULL << 31))
+      postStatusMsg(2) << "#osp:pkd: more than 2^31 particles, using 64-bit traversal";
+
     // Attribute culling on the lidar type-punned RGB data doesn't make sense, so don't do it
 #if !PKD_LIDAR_ENABLED
-    if (attribute) {
-      postStatusMsg(2) << "#osp:pkd: found attribute, computing range and min/max bit array";
-      attr_lo = attr_hi = attribute[0];
-      for (size_t i=0;i<numParticles;i++) {
-        attr_lo = std::min(attr_lo,attribute[i]);
-        attr_hi = std::max(attr_hi,attribute[i]);
-      }
+    if (attribute && numInnerNodes > 0) {
+      // all of them, so switching the active one later on is cheap
+      for (size_t i=0;i<numAttributes;i++)
+        getRangeTree(attributes[i],numInnerNodes);
+      Attribute &active = attributes[activeAttribute];
+      binBitsArray = getRangeTree(active,numInnerNodes);
+      attr_lo = active.binning.lo;
+      attr_hi = active.binning.hi;
+      activeBins = active.binning.numBins;
+      // the transfer function gets binned in normalized attribute space
+      for (size_t i=0;i<active.binning.edges.size();i++)
+        activeBinEdges.push_back((active.binning.edges[i]-attr_lo)/(attr_hi-attr_lo));
+      postStatusMsg(2) << "#osp:pkd: active attribute " << activeAttribute << " of "
+        << numAttributes << ", range [" << attr_lo << ".."
+        << attr_hi << "], " << activeBins << " bins, root bits "
+        << (int*)(int64)binBitsArray[0];
+
+      if (lodArray)
+        lodMeanArray = getLODMean(active,numInnerNodes);
 
-      binBitsArray = new uint32[numInnerNodes];
-      size_t numBytesRangeTree = numInnerNodes * sizeof(uint32);
-      postStatusMsg(2) << "#osp:pkd: num bytes in range tree " << numBytesRangeTree;
-      for (long long pID=numInnerNodes-1;pID>=0;--pID) {
-        size_t lID = 2*pID+1;
-        size_t rID = lID+1;
-        uint32 lBits = 0, rBits = 0;
-        if (rID < numInnerNodes)
-          rBits = binBitsArray[rID];
-        else if (rID < numParticles)
-          rBits = getAttributeBits(attribute[rID],attr_lo,attr_hi);
-        if (lID < numInnerNodes)
-          lBits = binBitsArray[lID];
-        else if (lID < numParticles)
-          lBits = getAttributeBits(attribute[lID],attr_lo,attr_hi);
-        binBitsArray[pID] = lBits|rBits;
+      if (clipRequested) {
+        // rounded outwards, and clamped to just outside the 16-bit range
+        minMaxArray = getMinMaxTree(active,numInnerNodes);
+        const double qLo = pkd::quantizedAttributeOf(clipRange.x,attr_lo,attr_hi);
+        const double qHi = pkd::quantizedAttributeOf(clipRange.y,attr_lo,attr_hi);
+        clipQLo = int32(std::max(-1.,std::min(65536.,floor(qLo))));
+        clipQHi = int32(std::max(-1.,std::min(65536.,ceil(qHi))));
       }
-      postStatusMsg(2) << "#osp:pkd: found attribute [" << attr_lo << ".."
-        << attr_hi << "], root bits " << (int*)(int64)binBitsArray[0];
+    }
+    if (attribute && clipRequested) {
+      clipAttribute = true;
+      postStatusMsg(2) << "#osp:pkd: clipping attribute to ["
+        << clipRange.x << ".." << clipRange.y << "]";
     }
 #endif
 
@@ -169,18 +538,50 @@ namespace ospray {
     ispc::PartiKDGeometry_set(getIE(),
                               model->getIE(),
                               isQuantized,
+                              (ispc::vec3f&)quantization.origin,
+                              (ispc::vec3f&)quantization.scale,
+                              format == OSP_UINT ? quantizationFrameLevels : 0,
+                              format == OSP_UINT ? (ispc::vec3f*)quantizationFrameData->data : NULL,
+                              treeletFrameBegin.empty() ? NULL : (uint64_t*)&treeletFrameBegin[0],
                               useSPMD,
                               transferFunction?transferFunction->getIE():NULL,
                               particleRadius,
+                              radiusData ? (float*)radiusData->data : NULL,
+                              (float*)maxRadiusArray,
                               numParticles,
                               numInnerNodes,
                               (ispc::PKDParticle*)particle,
-                              attribute,
-                              binBitsArray,
+                              (void*)attribute,
+                              attributeBytes,
+                              attributeQLo,
+                              attributeQScale,
+                              (uint32*)binBitsArray,
                               (ispc::box3f&)centerBounds,
                               (ispc::box3f&)sphereBounds,
                               attr_lo,
-                              attr_hi);
+                              attr_hi,
+                              numTreelets,
+                              (uint64_t*)&treeletBegin[0],
+                              (ispc::box3f*)&treeletBounds[0],
+                              (uint64_t*)&treeletMaskBegin[0],
+                              activeBins,
+                              activeBinEdges.empty() ? NULL : &activeBinEdges[0],
+                              opacityThreshold,
+                              (uint32*)minMaxArray,
+                              clipAttribute,
+                              clipRange.x,
+                              clipRange.y,
+                              clipQLo,
+                              clipQHi,
+                              useStream,
+                              streamDepth,
+                              blockLevels,
+                              (float*)lodArray,
+                              (float*)lodMeanArray,
+                              lodArray ? lodScale : 0.f,
+                              wideArray ? wideLevels : 0,
+                              (float*)wideArray,
+                              wideArray ? (uint64_t*)&treeletWideBegin[0] : NULL);
 
     if (transferFunction) {
       ispc::PartiKDGeometry_updateTransferFunction(this->getIE(),
@@ -19,6 +19,17 @@
 #include "ospray/geometry/Geometry.h"
 #include "ospray/common/Data.h"
 #include "ospray/transferFunction/TransferFunction.h"
+// this module
+#include "PKDRangeTree.h"
+#include "PKDQuantization.h"
+#include "PKDLOD.h"
+#include "PKDWide.h"
+
+/*! default number of tree levels the stream traversal ("useStream")
+    traverses once per ray stream */
+#define PKD_DEFAULT_STREAM_DEPTH 6
+/*! max streamDepth; has to match PKD_MAX_STREAM_DEPTH in PKDGeometry.ih */
+#define PKD_MAX_STREAM_DEPTH 16
 
 namespace ospray {
 
@@ -26,6 +37,9 @@ namespace ospray {
   struct PartiKDGeometry : public ospray::Geometry {
     //! Constructor
     PartiKDGeometry();
+    /*! Destructor; also deletes the pkd::FileMemory (see PKDMemory.h)
+        given as "fileMemory", if any */
+    virtual ~PartiKDGeometry();
 
     //! \brief common function to help printf-debugging 
     virtual std::string toString() const { return "ospray::PartiKDGeometry"; }
@@ -44,17 +58,139 @@ namespace ospray {
     //! transfer function for color/alpha mapping, may be NULL
     Ref<TransferFunction> transferFunction;
     Ref<Data> particleData;
-    Ref<Data> attributeData;
 
-    float    *attribute;
-    OSPDataType format; //!< format of the particles: float3, or uint64
+    /*! one per-particle attribute, with its range tree */
+    struct Attribute {
+      Attribute()
+        : isQuantized(false), rangeTreeSource(NULL), binningType(pkd::BINNING_LINEAR),
+          minMaxTreeSource(NULL), lodMeanSource(NULL)
+      {}
+
+      Ref<Data> data;
+      /*! whether data is uint8/uint16 ("attributeQuantizedRange.<i>"
+          gives the range those decode to) rather than float */
+      bool isQuantized;
+      pkd::AttributeQuantization quantization;
+      /*! the range tree, if given by the file (along with the range
+          and - for non-linear binnings - the bin edges it was built
+          with), or NULL */
+      Ref<Data> rangeTreeData;
+      Ref<Data> binEdgesData;
+      //! the range tree we computed ourselves if the file didn't have one
+      std::vector<uint32> rangeTree;
+      //! the attribute data 'rangeTree' got computed for
+      const void *rangeTreeSource;
+      //! how the range tree maps attribute values to bins
+      pkd::Binning     binning;
+      pkd::BinningType binningType;
+      /*! the min/max tree (quantized relative to binning.lo/hi), if
+          given by the file, or NULL */
+      Ref<Data> minMaxTreeData;
+      //! the min/max tree we computed ourselves if the file didn't have one
+      std::vector<uint32> minMaxTree;
+      //! the attribute data 'minMaxTree' got computed for
+      const void *minMaxTreeSource;
+      /*! per inner node, the mean value over its subtree (for
+          level-of-detail proxies), if given by the file, or NULL */
+      Ref<Data> lodMeanData;
+      //! the means we computed ourselves if the file didn't have them
+      std::vector<float> lodMean;
+      //! the attribute data 'lodMean' got computed for
+      const void *lodMeanSource;
+    };
+    /*! all attributes ("attribute.0", "attribute.1", ..., or just
+        "attribute"); "activeAttribute" selects the one that gets used
+        for color mapping and culling */
+    std::vector<Attribute> attributes;
+    int activeAttribute;
+
+    /*! @{ binning for the range trees we compute ourselves
+        ("attributeBins", "attributeBinning"); if either is set
+        explicitly, range trees from the file get ignored */
+    int              numBins;
+    pkd::BinningType binningType;
+    bool             binningRequested;
+    /*! @} */
+    //! the active attribute's bin edges, normalized to [0,1]
+    std::vector<float> activeBinEdges;
+
+    /*! make sure the given attribute's range tree (and binning) is
+        there, and return it */
+    const uint32 *getRangeTree(Attribute &attr, const size_t numInnerNodes);
+    /*! same for the min/max tree (only needed for clipping); needs
+        the range tree to be there */
+    const uint32 *getMinMaxTree(Attribute &attr, const size_t numInnerNodes);
+    /*! same for the per-inner-node means (only needed for
+        level-of-detail traversal) */
+    const float *getLODMean(Attribute &attr, const size_t numInnerNodes);
+    /*! the given attribute's values as floats: either its data, or
+        (for quantized attributes) their decoded versions in 'decoded' */
+    const float *valuesOf(const Attribute &attr, std::vector<float> &decoded) const;
+
+    //! the active attribute's values (NULL if there are none)
+    const void *attribute;
+    OSPDataType format; //!< format of the particles: float3, uint64, or uint32
+    /*! how uint64 particles decode ("quantization.origin" and
+        "quantization.scale"; lattice coordinates if not given) */
+    pkd::PositionQuantization quantization;
+    /*! @{ how uint32 particles decode: relative to the frame of their
+        block of quantizationFrameLevels tree levels (origin and scale
+        of each frame in "quantizationFrames"); each treelet's frames
+        start at treeletFrameBegin[i] */
+    Ref<Data> quantizationFrameData;
+    int quantizationFrameLevels;
+    std::vector<uint64> treeletFrameBegin;
+    /*! @} */
     union {
       void     *particle;
       vec3f    *particle3f;
       uint64   *particle1ul;
+      uint32   *particle1ui;
     };
     size_t    numParticles;
+    //! the particles' radius; with per-particle radii, the largest one
     float     particleRadius;
+    /*! @{ per-particle radii ("particleRadius", stored like the
+        particles; NULL if all particles have "radius"), and their max
+        radius tree (from "maxRadiusTree" or, if not given, computed
+        ourselves), see PKDRangeTree.h */
+    Ref<Data> radiusData;
+    Ref<Data> maxRadiusTreeData;
+    std::vector<float> maxRadiusTree;
+    /*! @} */
+    /*! @{ level-of-detail aggregates (centroid, radius of gyration,
+        count) of every inner node's subtree, from "lodTree" or, if not
+        given, computed ourselves, see PKDLOD.h */
+    Ref<Data> lodTreeData;
+    std::vector<pkd::LODAggregate> lodTree;
+    //! the particle data 'lodTree' got computed for
+    const void *lodTreeSource;
+    /*! @} */
+    /*! @{ wide nodes for k-ary traversal ("wideArity" 4 or 8, 0 for
+        binary traversal), from "wideNodes" or, if not given, computed
+        ourselves, see PKDWide.h; each treelet's start at
+        treeletWideBegin[i] */
+    int wideArity;
+    Ref<Data> wideNodeData;
+    std::vector<float> wideNodes;
+    //! the particle data 'wideNodes' got computed for
+    const void *wideNodesSource;
+    std::vector<uint64> treeletWideBegin;
+    /*! @} */
+
+    /*! @{ treelets: each one is a complete pkd tree over the particles
+        [treeletBegin[i],treeletBegin[i+1]), with its (center) bounds
+        in treeletBounds[i]. a file without treelets gets exactly one */
+    Ref<Data> treeletBeginData;
+    Ref<Data> treeletBoundsData;
+    std::vector<uint64> treeletBegin;
+    std::vector<box3f>  treeletBounds;
+    //! where each treelet's inner nodes start in the attribute range tree
+    std::vector<uint64> treeletMaskBegin;
+    /*! @} */
+    /*! memory layout of the particles within each treelet (see
+        PKDLayout.h): tree levels per block, or 0 for level order */
+    int blockLevels;
   };
   
 } // ::ospray
@@ -0,0 +1,157 @@
+// ======================================================================== //
+// Copyright 2009-2014 Intel Corporation                                    //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+/*! \file PKDLOD.h per-inner-node aggregates for level-of-detail
+    traversal: for every inner node, the number of particles in its
+    subtree, their centroid, and their radius of gyration (the rms
+    distance from the centroid) - and, per attribute, their mean
+    value. a subtree that is small enough on screen gets intersected as
+    a single 'proxy' sphere around its centroid instead of being
+    traversed. like the range tree (PKDRangeTree.h), these are stored
+    in level order, per treelet, back to back */
+
+#include "PKDRangeTree.h"
+#include "ospcommon/vec.h"
+// std
+#include <algorithm>
+#include <cmath>
+
+/*! default for the angle (in radians) a pixel covers: a 60 degree
+    field of view over about 1000 pixels */
+#define PKD_DEFAULT_LOD_PIXEL_ANGLE 0.001f
+
+namespace ospray {
+  namespace pkd {
+
+    /*! aggregate of an inner node's subtree; five floats, as stored
+        in the file (the count is exact up to 2^24 particles) */
+    struct LODAggregate {
+      ospcommon::vec3f centroid;
+      float radiusOfGyration;
+      float count;
+    };
+
+    //! aggregate of a single particle
+    inline LODAggregate lodAggregateOf(const ospcommon::vec3f &position)
+    {
+      LODAggregate a;
+      a.centroid = position;
+      a.radiusOfGyration = 0.f;
+      a.count = 1.f;
+      return a;
+    }
+
+    /*! aggregate of the union of two (disjoint) sets of particles:
+        the sum of squared distances from the joint centroid is that of
+        each set, plus each set's count times its centroid's squared
+        distance to the joint one */
+    inline LODAggregate mergeLODAggregates(const LODAggregate &a, const LODAggregate &b)
+    {
+      const double n = double(a.count)+double(b.count);
+      LODAggregate m;
+      m.count = float(n);
+      double sumSquares = a.count*double(a.radiusOfGyration)*a.radiusOfGyration
+        + b.count*double(b.radiusOfGyration)*b.radiusOfGyration;
+      for (int k=0;k<3;k++) {
+        const double c = (a.count*double(a.centroid[k])+b.count*double(b.centroid[k]))/n;
+        m.centroid[k] = float(c);
+        sumSquares += a.count*(a.centroid[k]-c)*(a.centroid[k]-c)
+          + b.count*(b.centroid[k]-c)*(b.centroid[k]-c);
+      }
+      m.radiusOfGyration = float(sqrt(sumSquares/n));
+      return m;
+    }
+
+    //! number of nodes in the subtree rooted at nodeID, of a tree over N
+    inline size_t subtreeSizeOf(const size_t nodeID, const size_t N)
+    {
+      size_t size = 0;
+      for (size_t first=nodeID, numInLevel=1; first<N; first=2*first+1, numInLevel*=2)
+        size += std::min(numInLevel,N-first);
+      return size;
+    }
+
+    /*! @{ compute the aggregates of all N/2 inner nodes of a tree over
+        N particles; 'positionOf(i)' returns the position of the
+        particle stored at i (in the given layout) */
+    template<typename PositionFct>
+    inline void computeLODTree(const PositionFct &positionOf, const size_t N,
+                               LODAggregate *lod, const int blockLevels=0)
+    {
+      const size_t numInnerNodes = N/2;
+      const BlockedLayout layout(N,blockLevels);
+      forEachInnerNodeBottomUp(N,[&](size_t pID){
+          LODAggregate a = lodAggregateOf(positionOf(layout.storageIndexOf(pID)));
+          for (size_t cID=2*pID+1;cID<=2*pID+2;cID++) {
+            if (cID < numInnerNodes)
+              a = mergeLODAggregates(a,lod[cID]);
+            else if (cID < N)
+              a = mergeLODAggregates(a,lodAggregateOf(positionOf(layout.storageIndexOf(cID))));
+          }
+          lod[pID] = a;
+        });
+    }
+
+    template<typename PositionFct>
+    inline void computeLODTree(const PositionFct &positionOf,
+                               const uint64_t *treeletBegin,
+                               const size_t numTreelets,
+                               LODAggregate *lod,
+                               const int blockLevels=0)
+    {
+      forEachTreelet(treeletBegin,numTreelets,
+                     [&](size_t, size_t begin, size_t size, size_t maskBegin){
+                       computeLODTree([&](size_t i){ return positionOf(begin+i); },
+                                      size,lod+maskBegin,blockLevels);
+                     });
+    }
+    /*! @} */
+
+    /*! @{ compute the mean attribute value of each inner node's subtree */
+    inline void computeLODMean(const float *attribute, const size_t N,
+                               float *mean, const int blockLevels=0)
+    {
+      const size_t numInnerNodes = N/2;
+      const BlockedLayout layout(N,blockLevels);
+      forEachInnerNodeBottomUp(N,[&](size_t pID){
+          double sum = attribute[layout.storageIndexOf(pID)];
+          for (size_t cID=2*pID+1;cID<=2*pID+2;cID++) {
+            if (cID < numInnerNodes)
+              sum += double(mean[cID])*subtreeSizeOf(cID,N);
+            else if (cID < N)
+              sum += attribute[layout.storageIndexOf(cID)];
+          }
+          mean[pID] = float(sum/subtreeSizeOf(pID,N));
+        });
+    }
+
+    inline void computeLODMean(const float *attribute,
+                               const uint64_t *treeletBegin,
+                               const size_t numTreelets,
+                               float *mean,
+                               const int blockLevels=0)
+    {
+      forEachTreelet(treeletBegin,numTreelets,
+                     [&](size_t, size_t begin, size_t size, size_t maskBegin){
+                       computeLODMean(attribute+begin,size,mean+maskBegin,blockLevels);
+                     });
+    }
+    /*! @} */
+
+  }
+}
@@ -0,0 +1,115 @@
+// ======================================================================== //
+// Copyright 2009-2014 Intel Corporation                                    //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+/*! \file PKDLayout.h memory layouts of the particle (and attribute)
+    arrays. the tree itself is always addressed by 'node IDs' in
+    level order (children of node i are 2i+1 and 2i+2); the layout
+    only determines where in memory each node gets stored:
+
+    - level order: node i is stored at i. after the first few levels,
+      every step down the tree touches a different cache line (and,
+      eventually, page)
+
+    - blocked: the tree is cut into rows of 'blockLevels' levels each,
+      and each row into complete subtrees ('blocks') of 2^blockLevels-1
+      nodes, each stored contiguously (in level order). blocks are
+      stored row by row, left to right, so a walk down the tree touches
+      one block per blockLevels levels. the last row's blocks only have
+      as many levels as the tree has left, and - the last tree level
+      being filled left to right - the blocks right of the last full
+      one are one level short.
+
+    PKDGeometry.ih has the same arithmetic for the traversal kernels */
+
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+
+/*! a block of that many levels has 64k-1 nodes - already more than
+    fits into a page of particles */
+#define PKD_MAX_BLOCK_LEVELS 16
+
+namespace ospray {
+  namespace pkd {
+
+    struct BlockedLayout {
+      /*! layout of a tree over numParticles nodes, with the given
+          number of levels per block (0 means plain level order) */
+      BlockedLayout(const size_t numParticles=0, const int blockLevels=0)
+        : blockLevels(blockLevels), numParticles(numParticles), lastRowDepth(0),
+          lastRowLevels(0), lastRowFullBlocks(0), lastRowRemainder(0)
+      {
+        if (blockLevels < 0 || blockLevels > PKD_MAX_BLOCK_LEVELS)
+          throw std::runtime_error("invalid number of levels per block "
+                                   +std::to_string(blockLevels));
+        if (blockLevels == 0 || numParticles == 0) return;
+        const int numLevels = depthOf(numParticles-1)+1;
+        lastRowDepth  = ((numLevels-1)/blockLevels)*blockLevels;
+        lastRowLevels = numLevels-lastRowDepth;
+        // nodes in the last tree level, and how many blocks they fill up
+        const size_t lastLevelNodes = numParticles - ((size_t(1)<<(numLevels-1))-1);
+        const size_t lastLevelPerBlock = size_t(1)<<(lastRowLevels-1);
+        lastRowFullBlocks = lastLevelNodes / lastLevelPerBlock;
+        lastRowRemainder  = lastLevelNodes % lastLevelPerBlock;
+      }
+
+      static int depthOf(const size_t nodeID)
+      {
+        int depth = 0;
+        for (size_t n=nodeID+1;n>1;n>>=1) ++depth;
+        return depth;
+      }
+
+      //! where in memory the given node goes
+      size_t storageIndexOf(const size_t nodeID) const
+      {
+        if (blockLevels == 0) return nodeID;
+        const int depth    = depthOf(nodeID);
+        const int local    = depth % blockLevels;
+        const int rowDepth = depth - local;
+        // (block root+1), block index in its row, and index in the block
+        const size_t root1 = (nodeID+1) >> local;
+        const size_t block = root1 - (size_t(1) << rowDepth);
+        const size_t inBlock = ((size_t(1) << local)-1) + ((nodeID+1) - (root1 << local));
+        const size_t rowBegin = (size_t(1) << rowDepth)-1;
+        if (rowDepth != lastRowDepth)
+          return rowBegin + block*((size_t(1) << blockLevels)-1) + inBlock;
+        const size_t fullSize  = (size_t(1) << lastRowLevels)-1;
+        const size_t shortSize = (size_t(1) << (lastRowLevels-1))-1;
+        const size_t blockBegin = block <= lastRowFullBlocks
+          ? block*fullSize
+          : lastRowFullBlocks*fullSize + shortSize + lastRowRemainder
+          + (block-lastRowFullBlocks-1)*shortSize;
+        return rowBegin + blockBegin + inBlock;
+      }
+
+      int    blockLevels;
+      size_t numParticles;
+      /*! @{ shape of the last row of blocks: its first level, number of
+          levels, and the number of blocks that have their last level
+          completely filled (plus the nodes in the last level of the one
+          after those) */
+      int    lastRowDepth;
+      int    lastRowLevels;
+      size_t lastRowFullBlocks;
+      size_t lastRowRemainder;
+      /*! @} */
+    };
+
+  }
+}
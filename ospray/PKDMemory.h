@@ -0,0 +1,339 @@
+// ======================================================================== //
+// Copyright 2009-2014 Intel Corporation                                    //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+/*! \file PKDMemory.h page size and NUMA placement of loaded .pkdbin
+    files. a plain mapFile() gets 4k pages, each placed on whichever
+    NUMA node touches it first - usually the loading thread's, so all
+    render threads end up reading through one memory controller. these
+    helpers instead read the file into anonymous memory that is backed
+    by (transparent or hugetlbfs) huge pages, and/or interleaved
+    across all NUMA nodes, and report where the pages ended up.
+    linux only; everywhere else loadFile() (and mapFile()) throw */
+
+#include "ospcommon/tasking/parallel_for.h"
+// std
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#ifdef __linux__
+// posix
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <sys/syscall.h>
+# include <unistd.h>
+#endif
+
+/*! bytes per (parallel) read when loading a file */
+#define PKD_LOAD_CHUNK_SIZE (size_t(64)<<20)
+/*! size of a hugetlbfs page (the default one on x86-64) */
+#define PKD_HUGETLB_PAGE_SIZE (size_t(2)<<20)
+/*! max number of pages whose NUMA node placementReport() looks up */
+#define PKD_REPORT_SAMPLES 4096
+
+namespace ospray {
+  namespace pkd {
+
+    typedef enum {
+      //! regular (4k) pages
+      HUGE_PAGES_OFF,
+      //! transparent huge pages (madvise), falls back to 4k pages
+      HUGE_PAGES_THP,
+      //! hugetlbfs pages; have to be reserved (vm.nr_hugepages)
+      HUGE_PAGES_HUGETLB
+    } HugePages;
+
+    typedef enum {
+      //! pages go to the node of the thread that first touches them
+      NUMA_FIRST_TOUCH,
+      //! pages go round-robin to all (online) nodes
+      NUMA_INTERLEAVE
+    } NumaPolicy;
+
+    /*! how to place a loaded file in memory. fromEnvironment() reads
+        OSPRAY_PKD_HUGE_PAGES (off|thp|hugetlb) and OSPRAY_PKD_NUMA
+        (first-touch|interleave) */
+    struct LoadOptions {
+      LoadOptions() : hugePages(HUGE_PAGES_OFF), numa(NUMA_FIRST_TOUCH) {}
+
+      //! whether any of this needs loadFile() (rather than a plain mapFile())
+      bool any() const { return hugePages != HUGE_PAGES_OFF || numa != NUMA_FIRST_TOUCH; }
+
+      static LoadOptions fromEnvironment()
+      {
+        LoadOptions options;
+        const char *hugePages = getenv("OSPRAY_PKD_HUGE_PAGES");
+        if (hugePages) {
+          const std::string s = hugePages;
+          if (s == "thp")          options.hugePages = HUGE_PAGES_THP;
+          else if (s == "hugetlb") options.hugePages = HUGE_PAGES_HUGETLB;
+          else if (s != "off" && s != "")
+            throw std::runtime_error("invalid OSPRAY_PKD_HUGE_PAGES '"+s
+                                     +"' (has to be off, thp, or hugetlb)");
+        }
+        const char *numa = getenv("OSPRAY_PKD_NUMA");
+        if (numa) {
+          const std::string s = numa;
+          if (s == "interleave") options.numa = NUMA_INTERLEAVE;
+          else if (s != "first-touch" && s != "")
+            throw std::runtime_error("invalid OSPRAY_PKD_NUMA '"+s
+                                     +"' (has to be first-touch or interleave)");
+        }
+        return options;
+      }
+
+      HugePages  hugePages;
+      NumaPolicy numa;
+    };
+
+#ifdef __linux__
+    /*! the online NUMA nodes, as a bit mask (from sysfs; just node 0
+        if there is no such thing) */
+    inline std::vector<unsigned long> onlineNumaNodes()
+    {
+      std::vector<unsigned long> mask(1,0);
+      FILE *file = fopen("/sys/devices/system/node/online","r");
+      char line[1024] = "0";
+      if (file) {
+        if (!fgets(line,sizeof(line),file))
+          strcpy(line,"0");
+        fclose(file);
+      }
+      // a list of ranges, like "0-1,4"
+      std::stringstream ss(line);
+      std::string range;
+      while (std::getline(ss,range,',')) {
+        int lo = 0, hi = 0;
+        const int n = sscanf(range.c_str(),"%d-%d",&lo,&hi);
+        if (n < 1) continue;
+        if (n == 1) hi = lo;
+        for (int node=lo;node<=hi;node++) {
+          const size_t word = node/(8*sizeof(unsigned long));
+          if (word >= mask.size()) mask.resize(word+1,0);
+          mask[word] |= 1UL << (node%(8*sizeof(unsigned long)));
+        }
+      }
+      return mask;
+    }
+
+    //! size of the memory loadFile() allocates for a file of that size
+    inline size_t loadedSizeOf(const size_t fileSize, const LoadOptions &options)
+    {
+      const size_t pageSize = options.hugePages == HUGE_PAGES_HUGETLB
+        ? PKD_HUGETLB_PAGE_SIZE : sysconf(_SC_PAGESIZE);
+      return std::max(pageSize,(fileSize+pageSize-1)/pageSize*pageSize);
+    }
+
+    /*! read the given file into freshly allocated memory, placed as
+        'options' asks; release it with unmapFile() (or hand it to a
+        FileMemory). throws if anything goes wrong */
+    inline unsigned char *loadFile(const std::string &fileName,
+                                   const LoadOptions &options,
+                                   size_t &fileSize)
+    {
+      const int fd = open(fileName.c_str(),O_RDONLY);
+      if (fd < 0)
+        throw std::runtime_error("could not open '"+fileName+"'");
+      struct stat st;
+      if (fstat(fd,&st) != 0) {
+        close(fd);
+        throw std::runtime_error("could not stat '"+fileName+"'");
+      }
+      fileSize = st.st_size;
+
+      const size_t size = loadedSizeOf(fileSize,options);
+      int flags = MAP_PRIVATE|MAP_ANONYMOUS;
+      if (options.hugePages == HUGE_PAGES_HUGETLB)
+        flags |= MAP_HUGETLB;
+      void *ptr = mmap(NULL,size,PROT_READ|PROT_WRITE,flags,-1,0);
+      if (ptr == MAP_FAILED) {
+        close(fd);
+        throw std::runtime_error(options.hugePages == HUGE_PAGES_HUGETLB
+                                 ? "could not allocate huge pages for '"+fileName
+                                 +"' (are enough reserved in /proc/sys/vm/nr_hugepages?)"
+                                 : "could not allocate memory for '"+fileName+"'");
+      }
+      if (options.hugePages == HUGE_PAGES_THP)
+        // only a hint; the kernel may still (partly) use 4k pages
+        madvise(ptr,size,MADV_HUGEPAGE);
+      if (options.numa == NUMA_INTERLEAVE) {
+        // has to happen before the first touch; MPOL_INTERLEAVE is 3
+        // (we don't want to depend on libnuma for numaif.h)
+        std::vector<unsigned long> nodes = onlineNumaNodes();
+        if (syscall(SYS_mbind,ptr,size,3,&nodes[0],
+                    (unsigned long)(nodes.size()*8*sizeof(unsigned long)+1),0) != 0)
+          fprintf(stderr,"#osp:pkd: could not interleave '%s' across NUMA nodes\n",
+                  fileName.c_str());
+      }
+
+      // first touch happens here, in parallel
+      const size_t numChunks = (fileSize+PKD_LOAD_CHUNK_SIZE-1)/PKD_LOAD_CHUNK_SIZE;
+      std::atomic<bool> failed(false);
+      ospcommon::tasking::parallel_for(numChunks,[&](size_t chunkID){
+          const size_t begin = chunkID*PKD_LOAD_CHUNK_SIZE;
+          const size_t end   = std::min(begin+PKD_LOAD_CHUNK_SIZE,fileSize);
+          for (size_t ofs=begin;ofs<end;) {
+            const ssize_t n = pread(fd,(unsigned char *)ptr+ofs,end-ofs,ofs);
+            if (n <= 0) { failed = true; return; }
+            ofs += n;
+          }
+        });
+      close(fd);
+      if (failed) {
+        munmap(ptr,size);
+        throw std::runtime_error("could not read '"+fileName+"'");
+      }
+      return (unsigned char *)ptr;
+    }
+
+    /*! map the given file (read-only, shared), so its pages get
+        faulted in as they are touched; release it with unmapFile() (or
+        hand it to a FileMemory). throws if anything goes wrong */
+    inline unsigned char *mapFile(const std::string &fileName, size_t &fileSize)
+    {
+      const int fd = open(fileName.c_str(),O_RDONLY);
+      if (fd < 0)
+        throw std::runtime_error("could not open '"+fileName+"'");
+      struct stat st;
+      if (fstat(fd,&st) != 0) {
+        close(fd);
+        throw std::runtime_error("could not stat '"+fileName+"'");
+      }
+      fileSize = st.st_size;
+      void *ptr = mmap(NULL,std::max(fileSize,size_t(1)),PROT_READ,MAP_SHARED,fd,0);
+      close(fd);
+      if (ptr == MAP_FAILED)
+        throw std::runtime_error("could not map '"+fileName+"'");
+      return (unsigned char *)ptr;
+    }
+
+    /*! release what loadFile() (if options.any()) or mapFile() returned
+        for a file of the given size, once nothing refers to the memory
+        any more */
+    inline void unmapFile(unsigned char *ptr, const size_t fileSize,
+                          const LoadOptions &options)
+    {
+      munmap(ptr,options.any() ? loadedSizeOf(fileSize,options) : std::max(fileSize,size_t(1)));
+    }
+
+    /*! a one-line summary of how the given memory is backed: how much
+        of it is in huge pages, and how its pages (a sample of them)
+        are distributed across NUMA nodes */
+    inline std::string placementReport(const void *ptr, const size_t size)
+    {
+      std::stringstream report;
+      report << (size>>20) << " MB";
+
+      // huge pages: from the smaps entry of the mapping
+      FILE *smaps = fopen("/proc/self/smaps","r");
+      if (smaps) {
+        char line[1024];
+        bool inMapping = false;
+        size_t kernelPageKB = 0, anonHugeKB = 0;
+        while (fgets(line,sizeof(line),smaps)) {
+          unsigned long lo, hi;
+          if (sscanf(line,"%lx-%lx ",&lo,&hi) == 2) {
+            inMapping = lo == (unsigned long)ptr;
+            continue;
+          }
+          if (!inMapping) continue;
+          size_t kb;
+          if (sscanf(line,"KernelPageSize: %zu kB",&kb) == 1) kernelPageKB = kb;
+          if (sscanf(line,"AnonHugePages: %zu kB",&kb) == 1)  anonHugeKB = kb;
+        }
+        fclose(smaps);
+        if (kernelPageKB)
+          report << ", " << kernelPageKB << " kB pages";
+        if (anonHugeKB)
+          report << ", " << (anonHugeKB>>10) << " MB in transparent huge pages";
+      }
+
+      // NUMA nodes: ask move_pages (without moving anything) for a sample
+      const size_t pageSize = sysconf(_SC_PAGESIZE);
+      const size_t numPages = (size+pageSize-1)/pageSize;
+      const size_t numSamples = std::min(numPages,size_t(PKD_REPORT_SAMPLES));
+      if (numSamples == 0) return report.str();
+      std::vector<void *> page(numSamples);
+      std::vector<int>    status(numSamples,-1);
+      for (size_t i=0;i<numSamples;i++)
+        page[i] = (unsigned char *)ptr + (i*numPages/numSamples)*pageSize;
+      if (syscall(SYS_move_pages,0,numSamples,&page[0],NULL,&status[0],0) != 0)
+        return report.str();
+      std::vector<size_t> pagesOnNode;
+      for (size_t i=0;i<numSamples;i++)
+        if (status[i] >= 0) {
+          if (status[i] >= (int)pagesOnNode.size()) pagesOnNode.resize(status[i]+1,0);
+          pagesOnNode[status[i]]++;
+        }
+      report << ", pages per node:";
+      for (size_t node=0;node<pagesOnNode.size();node++)
+        report << " " << node << ":" << (100*pagesOnNode[node]/numSamples) << "%";
+      return report.str();
+    }
+#else
+    inline unsigned char *loadFile(const std::string &fileName,
+                                   const LoadOptions &, size_t &)
+    {
+      throw std::runtime_error("huge page and NUMA placement of '"+fileName
+                               +"' is only supported on linux");
+    }
+
+    inline unsigned char *mapFile(const std::string &fileName, size_t &)
+    {
+      throw std::runtime_error("mapping '"+fileName+"' is only supported on linux");
+    }
+
+    inline void unmapFile(unsigned char *, const size_t, const LoadOptions &)
+    {
+    }
+
+    inline std::string placementReport(const void *, const size_t size)
+    {
+      std::stringstream report;
+      report << (size>>20) << " MB";
+      return report.str();
+    }
+#endif
+
+    /*! owns what loadFile()/mapFile() returned, and releases it (see
+        unmapFile()) when deleted. a geometry that gets one as its
+        "fileMemory" parameter deletes it along with itself, after
+        which nothing refers to the memory any more */
+    struct FileMemory {
+      FileMemory(unsigned char *ptr, const size_t fileSize, const LoadOptions &options)
+        : ptr(ptr), fileSize(fileSize), options(options)
+      {}
+      ~FileMemory() { unmapFile(ptr,fileSize,options); }
+
+      unsigned char *const ptr;
+      const size_t        fileSize;
+      const LoadOptions   options;
+
+    private:
+      FileMemory(const FileMemory &);
+      FileMemory &operator=(const FileMemory &);
+    };
+
+  }
+}
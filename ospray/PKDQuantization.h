@@ -0,0 +1,292 @@
+// ======================================================================== //
+// Copyright 2009-2014 Intel Corporation                                    //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+/*! \file PKDQuantization.h encoding and decoding of quantized
+    particles and attributes, shared by the pkd builder, the pkd
+    geometry, and the scene graph.
+
+    a quantized particle is one uint64: the split dim in the lower 2
+    bits, followed by 20 bits each of x, y, and z lattice coordinates.
+    it decodes to origin + lattice*scale, ie, to the center of its
+    lattice cell; since both encoding and decoding are monotonic, the
+    decoded particles still form a valid pkd tree.
+
+    quantized attributes are uint8 or uint16 values, decoding to
+    lo + q*(hi-lo)/(2^bits-1).
+
+    'relatively' quantized particles are one uint32: the split dim,
+    followed by 10 bits per coordinate, relative to the 'frame' of the
+    block (of frameLevels tree levels, see PKDLayout.h) the particle
+    is in. each frame has its own origin and scale, chosen top-down so
+    that every particle decodes to the correct side of all its
+    ancestors' (decoded) split planes */
+
+#include "PKDLayout.h"
+#include "ospcommon/box.h"
+#include "ospcommon/tasking/parallel_for.h"
+// std
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace ospray {
+  namespace pkd {
+
+    //! bits per coordinate of a quantized (uint64) particle
+    enum { QUANTIZED_POSITION_BITS = 20 };
+    //! bits per coordinate of a relatively quantized (uint32) particle
+    enum { RELATIVE_POSITION_BITS = 10 };
+    /*! frames above this depth get their subtrees quantized in
+        parallel */
+    enum { RELATIVE_PARALLEL_DEPTH = 12 };
+
+    struct PositionQuantization {
+      /*! the identity (origin 0, scale 1), which is what files
+          written before quantized files had an origin and scale
+          decode with */
+      PositionQuantization() : origin(0.f), scale(1.f) {}
+      PositionQuantization(const ospcommon::vec3f &origin, const ospcommon::vec3f &scale)
+        : origin(origin), scale(scale)
+      {}
+
+      //! the lattice that covers the given (center) bounds
+      static PositionQuantization of(const ospcommon::box3f &bounds)
+      {
+        const float numCells = float(1<<QUANTIZED_POSITION_BITS);
+        ospcommon::vec3f scale = (bounds.upper-bounds.lower)/numCells;
+        // flat dimensions still need a (any) non-zero scale
+        for (int k=0;k<3;k++)
+          if (!(scale[k] > 0.f)) scale[k] = 1.f;
+        return PositionQuantization(bounds.lower+.5f*scale,scale);
+      }
+
+      //! lattice coordinates of the given point, clamped to the lattice
+      ospcommon::vec3f latticeOf(const ospcommon::vec3f &p) const
+      {
+        const float maxCoord = float((1<<QUANTIZED_POSITION_BITS)-1);
+        ospcommon::vec3f q;
+        for (int k=0;k<3;k++)
+          q[k] = std::max(0.f,std::min(maxCoord,floorf((p[k]-origin[k])/scale[k]+.5f)));
+        return q;
+      }
+
+      uint64_t encode(const ospcommon::vec3f &p, const uint32_t dim) const
+      {
+        const ospcommon::vec3f q = latticeOf(p);
+        return (uint64_t(q.x) << 2) | (uint64_t(q.y) << 22) | (uint64_t(q.z) << 42) | dim;
+      }
+
+      //! the decoded position of a lattice point
+      ospcommon::vec3f decodeLattice(const ospcommon::vec3f &q) const
+      { return origin + q*scale; }
+
+      ospcommon::vec3f decode(const uint64_t bits) const
+      {
+        const uint64_t mask = (1<<QUANTIZED_POSITION_BITS)-1;
+        return decodeLattice(ospcommon::vec3f((bits >> 2) & mask,
+                                              (bits >> 22) & mask,
+                                              (bits >> 42) & mask));
+      }
+
+      //! bounds (in lattice space, see computeBounds()) to world space
+      ospcommon::box3f decode(const ospcommon::box3f &latticeBounds) const
+      {
+        if (latticeBounds.lower.x > latticeBounds.upper.x)
+          return latticeBounds;
+        return ospcommon::box3f(decodeLattice(latticeBounds.lower),
+                                decodeLattice(latticeBounds.upper));
+      }
+
+      /*! bounds of the decoded versions of all particles inside the
+          given (world space) bounds */
+      ospcommon::box3f quantize(const ospcommon::box3f &bounds) const
+      {
+        return ospcommon::box3f(decodeLattice(latticeOf(bounds.lower)),
+                                decodeLattice(latticeOf(bounds.upper)));
+      }
+
+      ospcommon::vec3f origin;
+      ospcommon::vec3f scale;
+    };
+
+    /*! the local lattice of one block of relatively quantized
+        particles: a particle decodes to origin + lattice*scale */
+    struct QuantizationFrame {
+      ospcommon::vec3f origin;
+      ospcommon::vec3f scale;
+
+      ospcommon::vec3f decode(const uint32_t bits) const
+      {
+        const uint32_t mask = (1<<RELATIVE_POSITION_BITS)-1;
+        return origin + ospcommon::vec3f((bits >> 2) & mask,
+                                         (bits >> 12) & mask,
+                                         (bits >> 22) & mask)*scale;
+      }
+    };
+
+    //! number of frames (blocks of frameLevels levels) of a tree over N particles
+    inline size_t numFramesOf(const size_t N, const int frameLevels)
+    {
+      size_t numFrames = 0;
+      for (int rowDepth=0;rowDepth<64 && (size_t(1)<<rowDepth)-1 < N;rowDepth+=frameLevels)
+        numFrames += std::min(size_t(1)<<rowDepth,N-((size_t(1)<<rowDepth)-1));
+      return numFrames;
+    }
+
+    /*! index of the frame the given node is in: frames are numbered
+        row by row (of frameLevels levels each), left to right */
+    inline size_t frameOf(const size_t nodeID, const int frameLevels)
+    {
+      const int depth    = BlockedLayout::depthOf(nodeID);
+      const int rowDepth = depth - depth % frameLevels;
+      const size_t root1 = (nodeID+1) >> (depth-rowDepth);
+      return ((size_t(1) << rowDepth)-1)/((size_t(1) << frameLevels)-1)
+        + (root1 - (size_t(1) << rowDepth));
+    }
+
+    /*! relatively quantize the block of frameLevels levels rooted at
+        'root' (whose particles all have to decode inside 'inside'),
+        then (recursively) all blocks below it. 'position' and
+        'quantized' are in the given layout, 'frame' is indexed by
+        frameOf() */
+    inline void quantizeRelative(const ospcommon::vec3f *position, const size_t N,
+                                 const BlockedLayout &layout, const int frameLevels,
+                                 const size_t root, const ospcommon::box3f &inside,
+                                 uint32_t *quantized, QuantizationFrame *frame)
+    {
+      // the block's nodes (in level order: level l is levelSize[l]
+      // nodes, starting with node levelFirst[l]), and the frame that
+      // covers them
+      std::vector<size_t> node, levelFirst, levelSize;
+      for (size_t first=root, numInLevel=1;
+           levelFirst.size()<frameLevels && first<N;
+           first=2*first+1, numInLevel*=2) {
+        levelFirst.push_back(first);
+        levelSize.push_back(std::min(first+numInLevel,N)-first);
+        for (size_t i=first;i<first+levelSize.back();i++)
+          node.push_back(i);
+      }
+      ospcommon::box3f bounds = ospcommon::empty;
+      for (size_t i=0;i<node.size();i++)
+        bounds.extend(position[layout.storageIndexOf(node[i])]);
+      const float maxCoord = float((1<<RELATIVE_POSITION_BITS)-1);
+      QuantizationFrame &f = frame[frameOf(root,frameLevels)];
+      for (int k=0;k<3;k++) {
+        // (the nodes' original positions may be slightly outside
+        // 'inside', which is in decoded space)
+        float lo = std::max(bounds.lower[k],inside.lower[k]);
+        float hi = std::min(bounds.upper[k],inside.upper[k]);
+        if (lo > hi)
+          lo = hi = std::min(std::max(bounds.lower[k],inside.lower[k]),inside.upper[k]);
+        f.origin[k] = lo;
+        f.scale[k]  = (hi-lo)/maxCoord;
+      }
+      for (size_t i=0;i<node.size();i++) {
+        const size_t slot = layout.storageIndexOf(node[i]);
+        ospcommon::vec3f p = position[slot];
+        uint32_t bits = ((int&)p.x) & 3;
+        for (int k=0;k<3;k++) {
+          const float q = f.scale[k] > 0.f
+            ? std::max(0.f,std::min(maxCoord,floorf((p[k]-f.origin[k])/f.scale[k]+.5f)))
+            : 0.f;
+          bits |= uint32_t(q) << (2+RELATIVE_POSITION_BITS*k);
+        }
+        quantized[slot] = bits;
+      }
+
+      // what the blocks below have to decode inside: 'inside', cut by
+      // the decoded split planes of all nodes above them
+      std::vector<ospcommon::box3f> nodeInside(node.size(),inside);
+      std::vector<std::pair<size_t,ospcommon::box3f>> child;
+      for (size_t level=0, i=0;level<levelFirst.size();level++)
+        for (size_t k=0;k<levelSize[level];k++, i++) {
+          const size_t nodeID = node[i];
+          const uint32_t bits = quantized[layout.storageIndexOf(nodeID)];
+          const int dim = bits & 3;
+          if (2*nodeID+1 >= N || dim > 2) continue;
+          const float split = f.decode(bits)[dim];
+          ospcommon::box3f left = nodeInside[i], right = nodeInside[i];
+          left.upper[dim]  = std::min(left.upper[dim],split);
+          right.lower[dim] = std::max(right.lower[dim],split);
+          for (int side=0;side<2;side++) {
+            const size_t childID = 2*nodeID+1+side;
+            if (childID >= N) continue;
+            const ospcommon::box3f &c = side ? right : left;
+            if (level+1 < levelFirst.size())
+              // the block's next level starts right after this one
+              nodeInside[i-k+levelSize[level]+(childID-levelFirst[level+1])] = c;
+            else
+              child.push_back(std::make_pair(childID,c));
+          }
+        }
+      auto recurse = [&](size_t i){
+        quantizeRelative(position,N,layout,frameLevels,child[i].first,child[i].second,
+                         quantized,frame);
+      };
+      if (BlockedLayout::depthOf(root) < RELATIVE_PARALLEL_DEPTH)
+        ospcommon::tasking::parallel_for(child.size(),recurse);
+      else
+        for (size_t i=0;i<child.size();i++) recurse(i);
+    }
+
+    /*! relatively quantize a whole tree of N particles; 'frame' has
+        to have numFramesOf(N,frameLevels) elements */
+    inline void quantizeRelative(const ospcommon::vec3f *position, const size_t N,
+                                 const BlockedLayout &layout, const int frameLevels,
+                                 uint32_t *quantized, QuantizationFrame *frame)
+    {
+      if (N == 0) return;
+      const float inf = std::numeric_limits<float>::infinity();
+      quantizeRelative(position,N,layout,frameLevels,0,
+                       ospcommon::box3f(ospcommon::vec3f(-inf),ospcommon::vec3f(+inf)),
+                       quantized,frame);
+    }
+
+    struct AttributeQuantization {
+      AttributeQuantization(const int bits=16, const float lo=0.f, const float hi=1.f)
+        : bits(bits), lo(lo), hi(hi)
+      {
+        if (bits != 8 && bits != 16)
+          throw std::runtime_error("invalid number of bits for a quantized attribute "
+                                   +std::to_string(bits)+" (has to be 8 or 16)");
+      }
+
+      //! largest quantized value
+      uint32_t maxValue() const { return (1u<<bits)-1; }
+      //! what a step of one quantized value is worth
+      float scale() const { return (hi-lo)/maxValue(); }
+
+      //! rounded to the nearest quantized value
+      uint32_t encode(const float value) const
+      {
+        if (!(hi > lo)) return 0;
+        const double q = floor((double(value)-lo)/(double(hi)-lo)*maxValue()+.5);
+        return uint32_t(std::max(0.,std::min(double(maxValue()),q)));
+      }
+
+      float decode(const uint32_t q) const { return lo + q*scale(); }
+
+      int   bits;
+      float lo, hi;
+    };
+
+  }
+}
@@ -0,0 +1,356 @@
+// ======================================================================== //
+// Copyright 2009-2014 Intel Corporation                                    //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+/*! \file PKDRangeTree.h the attribute 'range tree' used for culling
+    subtrees by transfer function: one mask of 'numBins' bits (stored
+    as numBins/32 uint32 words) per inner node, with bit i set if any
+    particle in the node's subtree has its attribute in the i'th bin
+    of [lo,hi]. bins are either equally wide, or bounded by explicit
+    edges (log scale, or equalized over the attribute histogram). The
+    range tree gets computed by the builder (and stored with the
+    tree), or - if the file doesn't have one - by the geometry itself.
+    same for the (optional) 'min/max tree' used for clipping subtrees
+    by attribute value, and the 'max radius tree' that bounds the
+    slabs of trees with per-particle radii */
+
+#include "PKDLayout.h"
+#include "ospcommon/tasking/parallel_for.h"
+// std
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace ospray {
+  namespace pkd {
+
+    enum { RANGE_TREE_BLOCK_SIZE = 64*1024 };
+    //! largest supported number of bins (ie, 4 mask words per node)
+    enum { RANGE_TREE_MAX_BINS = 128 };
+    /*! number of attribute values we sort to find the bin edges of
+        an equalized binning */
+    enum { RANGE_TREE_HISTOGRAM_SAMPLES = 1024*1024 };
+
+    typedef enum {
+      //! equally wide bins (the only kind older files have)
+      BINNING_LINEAR,
+      //! bin widths grow geometrically from lo to hi
+      BINNING_LOG,
+      //! every bin holds about the same number of particles
+      BINNING_EQUALIZED
+    } BinningType;
+
+    inline BinningType binningTypeOf(const std::string &name)
+    {
+      if (name == "" || name == "linear") return BINNING_LINEAR;
+      if (name == "log") return BINNING_LOG;
+      if (name == "equalized") return BINNING_EQUALIZED;
+      throw std::runtime_error("unknown attribute binning '"+name+"'");
+    }
+
+    inline const char *nameOf(const BinningType type)
+    {
+      switch (type) {
+      case BINNING_LOG:       return "log";
+      case BINNING_EQUALIZED: return "equalized";
+      default:                return "linear";
+      }
+    }
+
+    /*! maps attribute values to bins */
+    struct Binning {
+      Binning(const int numBins=32, const float lo=0.f, const float hi=0.f)
+        : numBins(numBins), lo(lo), hi(hi)
+      {}
+
+      //! number of mask words per inner node
+      int numWords() const { return numBins/32; }
+
+      int binOf(const float val) const
+      {
+        if (edges.empty()) {
+          if (hi == lo) return 0;
+          return std::min(numBins-1,int(numBins*((val-lo)/float(hi-lo))));
+        }
+        // bin i covers [edges[i],edges[i+1]); only the inner edges matter
+        const int bin = int(std::upper_bound(edges.begin()+1,edges.end()-1,val)
+                            - (edges.begin()+1));
+        return std::min(numBins-1,std::max(0,bin));
+      }
+
+      //! set the given value's bit in the 'numWords()' words of 'bits'
+      void setBit(const float val, uint32_t *bits) const
+      {
+        const int bin = binOf(val);
+        bits[bin/32] |= 1u<<(bin%32);
+      }
+
+      //! number of bins; a multiple of 32, at most RANGE_TREE_MAX_BINS
+      int numBins;
+      float lo, hi;
+      /*! numBins+1 bin boundaries (in attribute space, from lo to hi),
+          or empty for equally wide bins */
+      std::vector<float> edges;
+    };
+
+    /*! [lo,hi] range of the given attribute values, in parallel */
+    inline void computeAttributeRange(const float *attribute, const size_t N,
+                                      float &lo, float &hi)
+    {
+      lo = hi = attribute[0];
+      std::mutex mutex;
+      const size_t numBlocks = (N+RANGE_TREE_BLOCK_SIZE-1)/RANGE_TREE_BLOCK_SIZE;
+      ospcommon::tasking::parallel_for(numBlocks,[&](size_t blockID){
+          const size_t begin = blockID*RANGE_TREE_BLOCK_SIZE;
+          const size_t end   = std::min(begin+RANGE_TREE_BLOCK_SIZE,N);
+          float blockLo = attribute[begin], blockHi = attribute[begin];
+          for (size_t i=begin;i<end;i++) {
+            blockLo = std::min(blockLo,attribute[i]);
+            blockHi = std::max(blockHi,attribute[i]);
+          }
+          std::lock_guard<std::mutex> lock(mutex);
+          lo = std::min(lo,blockLo);
+          hi = std::max(hi,blockHi);
+        });
+    }
+
+    /*! set up the binning of the given attribute values: computes
+        their range, and (for non-linear binnings) the bin edges */
+    inline Binning computeBinning(const float *attribute, const size_t N,
+                                  const int numBins, const BinningType type)
+    {
+      if (numBins <= 0 || numBins > RANGE_TREE_MAX_BINS || numBins % 32)
+        throw std::runtime_error("invalid number of attribute bins "+std::to_string(numBins)
+                                 +" (has to be 32, 64, 96, or 128)");
+      Binning binning(numBins);
+      computeAttributeRange(attribute,N,binning.lo,binning.hi);
+      const float lo = binning.lo, hi = binning.hi;
+      if (type == BINNING_LINEAR || hi == lo)
+        return binning;
+
+      binning.edges.resize(numBins+1);
+      if (type == BINNING_LOG) {
+        // geometric steps from lo to hi; if the range includes zero
+        // (or negative values), shift it such that the first bin
+        // spans a millionth of the range
+        const float shift = lo > 0.f ? 0.f : (hi-lo)*1e-6f - lo;
+        const double logLo = log(double(lo+shift)), logHi = log(double(hi+shift));
+        for (int i=0;i<=numBins;i++)
+          binning.edges[i] = float(exp(logLo+(logHi-logLo)*i/numBins)) - shift;
+      } else {
+        // quantiles of a (strided) sample of the values
+        const size_t numSamples = std::min(N,size_t(RANGE_TREE_HISTOGRAM_SAMPLES));
+        std::vector<float> sample(numSamples);
+        for (size_t i=0;i<numSamples;i++)
+          sample[i] = attribute[(i*N)/numSamples];
+        std::sort(sample.begin(),sample.end());
+        for (int i=1;i<numBins;i++)
+          binning.edges[i] = sample[(i*numSamples)/numBins];
+      }
+      binning.edges[0] = lo;
+      binning.edges[numBins] = hi;
+      return binning;
+    }
+
+    /*! call 'nodeFct(nodeID)' for all N/2 inner nodes of a pkd tree
+        over N particles, bottom up, one level at a time; all nodes of a
+        level get done in parallel */
+    template<typename NodeFct>
+    inline void forEachInnerNodeBottomUp(const size_t N, const NodeFct &nodeFct)
+    {
+      const size_t numInnerNodes = N/2;
+      if (numInnerNodes == 0) return;
+
+      // first node of each inner level
+      std::vector<size_t> levelBegin;
+      for (size_t first=0;first<numInnerNodes;first=2*first+1)
+        levelBegin.push_back(first);
+
+      for (int level=int(levelBegin.size())-1;level>=0;--level) {
+        const size_t begin = levelBegin[level];
+        const size_t end   = std::min(2*begin+1,numInnerNodes);
+        const size_t numBlocks = (end-begin+RANGE_TREE_BLOCK_SIZE-1)/RANGE_TREE_BLOCK_SIZE;
+        ospcommon::tasking::parallel_for(numBlocks,[&](size_t blockID){
+            const size_t blockBegin = begin+blockID*RANGE_TREE_BLOCK_SIZE;
+            const size_t blockEnd   = std::min(blockBegin+RANGE_TREE_BLOCK_SIZE,end);
+            for (size_t pID=blockBegin;pID<blockEnd;pID++)
+              nodeFct(pID);
+          });
+      }
+    }
+
+    /*! call 'treeletFct(treeletID, begin, size, firstInnerNode)' for
+        every treelet, in parallel. per-inner-node arrays of all
+        treelets are stored back to back, so a treelet's first inner
+        node is the sum of the inner node counts of all treelets
+        before it */
+    template<typename TreeletFct>
+    inline void forEachTreelet(const uint64_t *treeletBegin, const size_t numTreelets,
+                               const TreeletFct &treeletFct)
+    {
+      std::vector<size_t> maskBegin(numTreelets);
+      size_t numInnerNodes = 0;
+      for (size_t i=0;i<numTreelets;i++) {
+        maskBegin[i] = numInnerNodes;
+        numInnerNodes += (treeletBegin[i+1]-treeletBegin[i])/2;
+      }
+      ospcommon::tasking::parallel_for(numTreelets,[&](size_t i){
+          treeletFct(i,treeletBegin[i],treeletBegin[i+1]-treeletBegin[i],maskBegin[i]);
+        });
+    }
+
+    /*! compute the range tree (N/2 masks of binning.numWords() words
+        each) of a single pkd tree over N particles. the attribute
+        values are stored in the given (see PKDLayout.h) layout; the
+        masks are always in level order */
+    inline void computeRangeTree(const float *attribute, const size_t N,
+                                 const Binning &binning,
+                                 uint32_t *bits,
+                                 const int blockLevels=0)
+    {
+      const size_t numInnerNodes = N/2;
+      const int numWords = binning.numWords();
+      const BlockedLayout layout(N,blockLevels);
+      forEachInnerNodeBottomUp(N,[&](size_t pID){
+          uint32_t *pBits = bits+pID*numWords;
+          std::fill(pBits,pBits+numWords,0u);
+          for (size_t cID=2*pID+1;cID<=2*pID+2;cID++) {
+            if (cID < numInnerNodes) {
+              for (int w=0;w<numWords;w++)
+                pBits[w] |= bits[cID*numWords+w];
+            } else if (cID < N)
+              binning.setBit(attribute[layout.storageIndexOf(cID)],pBits);
+          }
+        });
+    }
+
+    /*! compute the range trees of all treelets, stored back to back */
+    inline void computeRangeTree(const float *attribute,
+                                 const uint64_t *treeletBegin,
+                                 const size_t numTreelets,
+                                 const Binning &binning,
+                                 uint32_t *bits,
+                                 const int blockLevels=0)
+    {
+      forEachTreelet(treeletBegin,numTreelets,
+                     [&](size_t, size_t begin, size_t size, size_t maskBegin){
+                       computeRangeTree(attribute+begin,size,binning,
+                                        bits+maskBegin*binning.numWords(),blockLevels);
+                     });
+    }
+
+    /*! @{ the 'min/max tree': per inner node, the smallest and largest
+        attribute value in its subtree (node itself included), each
+        quantized to 16 bits relative to [lo,hi] - min rounded down,
+        max rounded up - and packed into one uint32 (min in the lower
+        half). culling compares quantized values only, so a subtree
+        only gets culled if it is guaranteed to be outside the range */
+
+    //! (unclamped, unrounded) quantized position of 'val' in [lo,hi]
+    inline double quantizedAttributeOf(const float val, const float lo, const float hi)
+    {
+      if (hi == lo) return 0.;
+      return (double(val)-lo)/(double(hi)-lo)*65535.;
+    }
+
+    inline uint32_t minMaxBitsOf(const float val, const float lo, const float hi)
+    {
+      const double q = quantizedAttributeOf(val,lo,hi);
+      const uint32_t qMin = (uint32_t)std::max(0.,std::min(65535.,floor(q)));
+      const uint32_t qMax = (uint32_t)std::max(0.,std::min(65535.,ceil(q)));
+      return qMin | (qMax << 16);
+    }
+
+    inline uint32_t mergeMinMaxBits(const uint32_t a, const uint32_t b)
+    {
+      return std::min(a & 0xffff,b & 0xffff) | std::max(a & 0xffff0000,b & 0xffff0000);
+    }
+
+    inline void computeMinMaxTree(const float *attribute, const size_t N,
+                                  const float lo, const float hi,
+                                  uint32_t *minMax,
+                                  const int blockLevels=0)
+    {
+      const size_t numInnerNodes = N/2;
+      const BlockedLayout layout(N,blockLevels);
+      forEachInnerNodeBottomUp(N,[&](size_t pID){
+          uint32_t bits = minMaxBitsOf(attribute[layout.storageIndexOf(pID)],lo,hi);
+          for (size_t cID=2*pID+1;cID<=2*pID+2;cID++) {
+            if (cID < numInnerNodes)
+              bits = mergeMinMaxBits(bits,minMax[cID]);
+            else if (cID < N)
+              bits = mergeMinMaxBits(bits,minMaxBitsOf(attribute[layout.storageIndexOf(cID)],lo,hi));
+          }
+          minMax[pID] = bits;
+        });
+    }
+
+    inline void computeMinMaxTree(const float *attribute,
+                                  const uint64_t *treeletBegin,
+                                  const size_t numTreelets,
+                                  const float lo, const float hi,
+                                  uint32_t *minMax,
+                                  const int blockLevels=0)
+    {
+      forEachTreelet(treeletBegin,numTreelets,
+                     [&](size_t, size_t begin, size_t size, size_t maskBegin){
+                       computeMinMaxTree(attribute+begin,size,lo,hi,minMax+maskBegin,blockLevels);
+                     });
+    }
+    /*! @} */
+
+    /*! @{ the 'max radius tree' of per-particle radii: per inner
+        node, the largest radius in its subtree (its own included),
+        which is how far that subtree's particles can reach across the
+        node's split plane. 'radius' is in the given layout, the tree
+        in level order */
+    inline void computeMaxRadiusTree(const float *radius, const size_t N,
+                                     float *maxRadius,
+                                     const int blockLevels=0)
+    {
+      const size_t numInnerNodes = N/2;
+      const BlockedLayout layout(N,blockLevels);
+      forEachInnerNodeBottomUp(N,[&](size_t pID){
+          float r = radius[layout.storageIndexOf(pID)];
+          for (size_t cID=2*pID+1;cID<=2*pID+2;cID++) {
+            if (cID < numInnerNodes)
+              r = std::max(r,maxRadius[cID]);
+            else if (cID < N)
+              r = std::max(r,radius[layout.storageIndexOf(cID)]);
+          }
+          maxRadius[pID] = r;
+        });
+    }
+
+    inline void computeMaxRadiusTree(const float *radius,
+                                     const uint64_t *treeletBegin,
+                                     const size_t numTreelets,
+                                     float *maxRadius,
+                                     const int blockLevels=0)
+    {
+      forEachTreelet(treeletBegin,numTreelets,
+                     [&](size_t, size_t begin, size_t size, size_t maskBegin){
+                       computeMaxRadiusTree(radius+begin,size,maxRadius+maskBegin,blockLevels);
+                     });
+    }
+    /*! @} */
+
+  }
+}
@@ -0,0 +1,157 @@
+// ======================================================================== //
+// Copyright 2009-2014 Intel Corporation                                    //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+/*! \file PKDSections.h which "pkd_geometry" parameter each section of
+    a .pkd file (container or xml, see PKDContainer.h) becomes. both
+    loaders - ospNewPKDGeometryFromFile (PKDFile.h) and the scene
+    graph importer (sg/PKD.cpp) - go through paramsOfSections, and
+    only differ in what they do with each parameter */
+
+#include "PKDContainer.h"
+#include "ospray/ospray.h"
+#include "ospcommon/vec.h"
+// std
+#include <iostream>
+#include <sstream>
+
+namespace ospray {
+  namespace pkd {
+
+    /*! gets handed the parameters of a .pkd file's sections, one by one */
+    struct ParamSink {
+      virtual ~ParamSink() {}
+      /*! the (count of) items of section 's', of the given type, as
+          parameter 'name'; the data stays where the section is */
+      virtual void setData(const std::string &name, const OSPDataType type,
+                           const Section &s) = 0;
+      virtual void set1i(const std::string &name, const int v) = 0;
+      virtual void set1f(const std::string &name, const float v) = 0;
+      virtual void set2f(const std::string &name, const ospcommon::vec2f &v) = 0;
+      virtual void set3f(const std::string &name, const ospcommon::vec3f &v) = 0;
+    };
+
+    inline ospcommon::vec3f vec3fOf(const std::string &s)
+    {
+      ospcommon::vec3f v;
+      std::stringstream(s) >> v.x >> v.y >> v.z;
+      return v;
+    }
+
+    /*! hand the parameters of the given sections to 'sink': attributes
+        become "attribute.<i>" (in file order), and their range trees,
+        bin edges, min/max trees and lod means get matched up with them
+        by attribute name. throws for unsupported formats, except for
+        attributes, which get skipped (with a warning) */
+    inline void paramsOfSections(const std::vector<Section> &sections, ParamSink &sink)
+    {
+      std::vector<std::string> attributeNames;
+      std::map<std::string, const Section *> rangeTree, binEdges, minMaxTree, lodMean;
+      auto setData = [&](const std::string &name, const OSPDataType type, const Section &s) {
+        if (s.count() > s.size/formatSizeOf(s.prop("format")))
+          throw std::runtime_error("section '"+s.name+"' smaller than its count");
+        sink.setData(name,type,s);
+      };
+      auto requireFormat = [](const Section &s, const std::string &format) {
+        if (s.prop("format") != format)
+          throw std::runtime_error("unsupported format '"+s.prop("format")+"' for "+s.name);
+      };
+      for (const Section &s : sections) {
+        const std::string format = s.prop("format");
+        if (s.name == "position") {
+          if (format == "vec3f" || format == "float3")
+            setData("position",OSP_FLOAT3,s);
+          else if (format == "uint64")
+            setData("position",OSP_ULONG,s);
+          else if (format == "uint32")
+            setData("position",OSP_UINT,s);
+          else
+            throw std::runtime_error("unsupported format '"+format+"' for position");
+        } else if (s.name == "quantizationFrames") {
+          setData("quantizationFrames",OSP_FLOAT3,s);
+          sink.set1i("quantizationFrameLevels",s.intProp("levels"));
+        } else if (s.name == "treeletBegin") {
+          requireFormat(s,"uint64");
+          setData("treeletBegin",OSP_ULONG,s);
+        } else if (s.name == "treeletBounds") {
+          requireFormat(s,"vec3f");
+          setData("treeletBounds",OSP_FLOAT3,s);
+        } else if (s.name == "particleRadius" || s.name == "maxRadiusTree"
+                   || s.name == "lodTree") {
+          requireFormat(s,"float");
+          setData(s.name,OSP_FLOAT,s);
+        } else if (s.name == "wideNodes") {
+          requireFormat(s,"float");
+          setData("wideNodes",OSP_FLOAT,s);
+          sink.set1i("wideArity",s.intProp("arity"));
+        } else if (s.name == "rangeTree") {
+          rangeTree[s.prop("attribute")] = &s;
+        } else if (s.name == "binEdges") {
+          binEdges[s.prop("attribute")] = &s;
+        } else if (s.name == "minMaxTree") {
+          minMaxTree[s.prop("attribute")] = &s;
+        } else if (s.name == "lodMean") {
+          lodMean[s.prop("attribute")] = &s;
+        } else if (s.name == "centerBounds") {
+          sink.set3f("centerBounds.lower",vec3fOf(s.prop("lower")));
+          sink.set3f("centerBounds.upper",vec3fOf(s.prop("upper")));
+        } else if (s.name == "quantization") {
+          sink.set3f("quantization.origin",vec3fOf(s.prop("origin")));
+          sink.set3f("quantization.scale",vec3fOf(s.prop("scale")));
+        } else if (s.name == "layout") {
+          if (s.prop("type") != "blocked")
+            throw std::runtime_error("unsupported pkd layout '"+s.prop("type")+"'");
+          sink.set1i("blockLevels",s.intProp("blockLevels"));
+        } else if (s.name == "radius") {
+          sink.set1f("radius",s.floatProp("value"));
+        } else if (s.name == "attribute") {
+          const std::string suffix = "."+std::to_string(attributeNames.size());
+          if (format == "float") {
+            setData("attribute"+suffix,OSP_FLOAT,s);
+          } else if (format == "uint8" || format == "uint16") {
+            // quantized, decoding to [lo,hi]
+            setData("attribute"+suffix,format == "uint8" ? OSP_UCHAR : OSP_USHORT,s);
+            sink.set2f("attributeQuantizedRange"+suffix,
+                       ospcommon::vec2f(s.floatProp("lo"),s.floatProp("hi")));
+          } else {
+            std::cout << "#osp:pkd: unsupported attribute format '" << format << "'" << std::endl;
+            continue;
+          }
+          attributeNames.push_back(s.prop("name"));
+        }
+      }
+      for (size_t i=0;i<attributeNames.size();i++) {
+        const std::string &name = attributeNames[i];
+        const std::string suffix = "."+std::to_string(i);
+        if (lodMean.find(name) != lodMean.end())
+          setData("attributeLODMean"+suffix,OSP_FLOAT,*lodMean[name]);
+        if (rangeTree.find(name) == rangeTree.end())
+          continue;
+        const Section &r = *rangeTree[name];
+        setData("attributeRangeTree"+suffix,OSP_UINT,r);
+        sink.set2f("attributeRange"+suffix,
+                   ospcommon::vec2f(r.floatProp("lo"),r.floatProp("hi")));
+        // non-linear binnings come with their bin edges
+        if (binEdges.find(name) != binEdges.end())
+          setData("attributeBinEdges"+suffix,OSP_FLOAT,*binEdges[name]);
+        if (minMaxTree.find(name) != minMaxTree.end())
+          setData("attributeMinMaxTree"+suffix,OSP_UINT,*minMaxTree[name]);
+      }
+    }
+
+  }
+}
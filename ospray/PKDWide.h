@@ -0,0 +1,139 @@
+// ======================================================================== //
+// Copyright 2009-2014 Intel Corporation                                    //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+/*! \file PKDWide.h 'wide' nodes for k-ary traversal of a pkd tree:
+    every 2 (or 3) levels of the binary tree get collapsed into one
+    node of arity 4 (or 8), whose 3 (or 7) particles are stored as a
+    structure of arrays - all x coordinates, then all y, all z, and
+    all split dims - so the traversal can test a ray against all of a
+    node's split planes at once, rather than one dependent step per
+    level. the wide nodes are a copy of the particles, used for
+    traversal only (attributes, radii, and hit IDs still refer to the
+    binary tree), and are numbered like a complete k-ary heap: wide
+    node w's children are k*w+1 .. k*w+k. like the range tree
+    (PKDRangeTree.h), treelets store theirs back to back */
+
+#include "PKDLayout.h"
+#include "ospcommon/vec.h"
+#include "ospcommon/tasking/parallel_for.h"
+// std
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+/*! split dim of wide node slots that are past the end of the tree */
+#define PKD_WIDE_NO_PARTICLE -1
+
+namespace ospray {
+  namespace pkd {
+
+    //! binary tree levels per wide node of the given arity (4 or 8)
+    inline int wideLevelsOf(const int arity)
+    {
+      if (arity == 4) return 2;
+      if (arity == 8) return 3;
+      throw std::runtime_error("invalid wide node arity (has to be 4 or 8)");
+    }
+
+    //! floats per wide node of the given number of levels
+    inline size_t wideNodeFloatsOf(const int levels)
+    {
+      return 4*((size_t(1) << levels)-1);
+    }
+
+    //! number of wide nodes of a tree over N particles
+    inline size_t numWideNodesOf(const size_t N, const int levels)
+    {
+      // wide depth D starts at binary node 2^(levels*D)-1
+      size_t count = 0;
+      for (size_t numInLevel=1; numInLevel-1<N; numInLevel <<= levels)
+        count += std::min(numInLevel,N-(numInLevel-1));
+      return count;
+    }
+
+    //! binary node ID of the root of wide node wideID
+    inline size_t wideRootOf(const size_t wideID, const int levels)
+    {
+      size_t first = 0, numInLevel = 1;
+      int depth = 0;
+      while (wideID >= first+numInLevel) {
+        first += numInLevel;
+        numInLevel <<= levels;
+        ++depth;
+      }
+      return ((size_t(1) << (levels*depth))-1) + (wideID-first);
+    }
+
+    /*! @{ compute the wide nodes of a tree over N particles;
+        'positionOf(i)' and 'dimOf(i)' return the position and split
+        dim of the particle stored at i (in the given layout) */
+    template<typename PositionFct, typename DimFct>
+    inline void computeWideNodes(const PositionFct &positionOf, const DimFct &dimOf,
+                                 const size_t N, const int levels, float *wide,
+                                 const int blockLevels=0)
+    {
+      const BlockedLayout layout(N,blockLevels);
+      const size_t B = (size_t(1) << levels)-1;
+      ospcommon::tasking::parallel_for(numWideNodesOf(N,levels),[&](size_t wideID){
+          float *node = wide + wideID*wideNodeFloatsOf(levels);
+          const size_t root = wideRootOf(wideID,levels);
+          for (size_t i=0;i<B;i++) {
+            // local node i is at depth l (within the wide node)
+            int l = 0;
+            while ((size_t(2) << l) <= i+1) ++l;
+            const size_t nodeID = ((root+1) << l)-1 + (i+1-(size_t(1) << l));
+            int32_t dim = PKD_WIDE_NO_PARTICLE;
+            ospcommon::vec3f p(0.f);
+            if (nodeID < N) {
+              const size_t slot = layout.storageIndexOf(nodeID);
+              p   = positionOf(slot);
+              dim = dimOf(slot);
+            }
+            node[i]     = p.x;
+            node[B+i]   = p.y;
+            node[2*B+i] = p.z;
+            (int32_t&)node[3*B+i] = dim;
+          }
+        });
+    }
+
+    template<typename PositionFct, typename DimFct>
+    inline void computeWideNodes(const PositionFct &positionOf, const DimFct &dimOf,
+                                 const uint64_t *treeletBegin,
+                                 const size_t numTreelets,
+                                 const int levels, float *wide,
+                                 const int blockLevels=0)
+    {
+      std::vector<size_t> wideBegin(numTreelets);
+      size_t numWideNodes = 0;
+      for (size_t i=0;i<numTreelets;i++) {
+        wideBegin[i] = numWideNodes;
+        numWideNodes += numWideNodesOf(treeletBegin[i+1]-treeletBegin[i],levels);
+      }
+      ospcommon::tasking::parallel_for(numTreelets,[&](size_t i){
+          const size_t begin = treeletBegin[i];
+          computeWideNodes([&](size_t j){ return positionOf(begin+j); },
+                           [&](size_t j){ return dimOf(begin+j); },
+                           treeletBegin[i+1]-begin,levels,
+                           wide+wideBegin[i]*wideNodeFloatsOf(levels),blockLevels);
+        });
+    }
+    /*! @} */
+
+  }
+}
@@ -21,6 +21,13 @@
 #include "sg/common/Common.h"
 #include "ospcommon/xml/XML.h"
 #include "ospcommon/constants.h"
+#include "../ospray/PKDBounds.h"
+#include "../ospray/PKDMemory.h"
+#include "../ospray/PKDQuantization.h"
+#include "../ospray/PKDLOD.h"
+#include "../ospray/PKDSections.h"
+// std
+#include <cstdlib>
 
 namespace ospray {
   namespace sg {
@@ -38,16 +45,34 @@ namespace ospray {
     {
 
       box3f box = empty;
-      if (hasChild("position")) {
+      if (hasChild("centerBounds.lower") && hasChild("centerBounds.upper")) {
+        // cached by the pkd file
+        box.lower = child("centerBounds.lower").valueAs<vec3f>();
+        box.upper = child("centerBounds.upper").valueAs<vec3f>();
+      } else if (hasChild("treeletBegin") && hasChild("treeletBounds")) {
+        // the union of the treelets' bounds is the bounds of all particles
+        auto treeletBounds = child("treeletBounds").nodeAs<DataBuffer>();
+        for (size_t i = 0; i < treeletBounds->size(); ++i)
+          box.extend(treeletBounds->get<vec3f>(i));
+      } else if (hasChild("position")) {
         auto pos = child("position").nodeAs<DataBuffer>();
         if (pos->getType() == OSP_FLOAT3) {
-          for (size_t i = 0; i < pos->size(); ++i) {
-            box.extend(pos->get<vec3f>(i));
-          }
+          box = pkd::computeBounds(static_cast<const float*>(pos->base()), pos->size());
         } else if (pos->getType() == OSP_ULONG) {
-          for (size_t i = 0; i < pos->size(); ++i) {
-            const uint64_t p = pos->get<uint64_t>(i);
-            box.extend(decodeParticle(p));
+          pkd::PositionQuantization quantization;
+          if (hasChild("quantization.origin") && hasChild("quantization.scale"))
+            quantization = pkd::PositionQuantization(child("quantization.origin").valueAs<vec3f>(),
+                                                     child("quantization.scale").valueAs<vec3f>());
+          box = quantization.decode(pkd::computeBounds(static_cast<const uint64_t*>(pos->base()),
+                                                       pos->size()));
+        } else if (pos->getType() == OSP_UINT && hasChild("quantizationFrames")) {
+          // relatively quantized: every particle is inside its frame
+          auto frames = child("quantizationFrames").nodeAs<DataBuffer>();
+          for (size_t i = 0; i + 1 < frames->size(); i += 2) {
+            const vec3f origin = frames->get<vec3f>(i);
+            const vec3f scale = frames->get<vec3f>(i + 1);
+            box.extend(origin);
+            box.extend(origin + scale * float((1 << pkd::RELATIVE_POSITION_BITS) - 1));
           }
         }
       }
@@ -59,14 +84,6 @@ namespace ospray {
       return box;
     }
 
-    vec3f PKDGeometry::decodeParticle(uint64_t i) const {
-      const uint64_t mask = (1 << 20) - 1;
-      const uint64_t ix = (i >> 2) & mask;
-      const uint64_t iy = (i >> 22) & mask;
-      const uint64_t iz = (i >> 42) & mask;
-      return vec3f(ix, iy, iz);
-    }
-
     void PKDGeometry::postCommit(RenderContext &)
     {
       auto geom = valueAs<OSPGeometry>();
@@ -75,64 +92,126 @@ namespace ospray {
       ospCommit(geom);
     }
 
+    /*! adds the parameters of a .pkd file's sections as children of
+        the PKDGeometry node, with data arrays that refer to the
+        (loaded or mapped) file */
+    struct PKDParamSink : public pkd::ParamSink {
+      PKDParamSink(std::shared_ptr<PKDGeometry> geom) : geom(geom), numAttributes(0) {}
+
+      virtual void setData(const std::string &name, const OSPDataType type,
+                           const pkd::Section &e)
+      {
+        const size_t count = e.count();
+        std::shared_ptr<DataBuffer> data;
+        switch (type) {
+        case OSP_FLOAT3:
+          data = std::make_shared<DataArray3f>(reinterpret_cast<vec3f*>(e.data), count, false);
+          break;
+        case OSP_ULONG:
+          data = std::make_shared<DataArrayT<uint64_t, OSP_ULONG>>(
+              reinterpret_cast<uint64_t*>(e.data), count, false);
+          break;
+        case OSP_UINT:
+          data = std::make_shared<DataArrayT<uint32_t, OSP_UINT>>(
+              reinterpret_cast<uint32_t*>(e.data), count, false);
+          break;
+        case OSP_USHORT:
+          data = std::make_shared<DataArrayT<uint16_t, OSP_USHORT>>(
+              reinterpret_cast<uint16_t*>(e.data), count, false);
+          break;
+        case OSP_UCHAR:
+          data = std::make_shared<DataArrayT<uint8_t, OSP_UCHAR>>(
+              reinterpret_cast<uint8_t*>(e.data), count, false);
+          break;
+        default:
+          data = std::make_shared<DataArray1f>(reinterpret_cast<float*>(e.data), count, false);
+        }
+        data->setName(name);
+        geom->add(data);
+
+        if (name == "position") {
+          std::cout << (type == OSP_FLOAT3 ? "Loading uncompressed PKD\n"
+                        : type == OSP_ULONG ? "Loading quantized PKD\n"
+                        : "Loading relatively quantized PKD\n");
+        } else if (e.name == "attribute") {
+          std::cout << "Got attribute " << numAttributes << ": " << e.prop("name") << "\n";
+          ++numAttributes;
+        } else if (name == "lodTree") {
+          // only if ospPartiKD was run with '--lod'; level of detail
+          // stays off until "lodPixelThreshold" gets set
+          geom->createChild("lodPixelThreshold", "float", 0.f);
+          geom->createChild("lodPixelAngle", "float", PKD_DEFAULT_LOD_PIXEL_ANGLE);
+        }
+      }
+      virtual void set1i(const std::string &name, const int v)
+      { geom->createChild(name, "int", v); }
+      virtual void set1f(const std::string &name, const float v)
+      { geom->createChild(name, "float", v); }
+      virtual void set2f(const std::string &name, const vec2f &v)
+      { geom->createChild(name, "vec2f", v); }
+      virtual void set3f(const std::string &name, const vec3f &v)
+      { geom->createChild(name, "vec3f", v); }
+
+      std::shared_ptr<PKDGeometry> geom;
+      size_t numAttributes;
+    };
+
     void importPKD(std::shared_ptr<Node> world, const ospcommon::FileName fileName)
     {
       std::cout << "Loading PKDGeometry from " << fileName << std::endl;
 
-      // Read the radius from the XML file
-      // Map the binary file and hand it off to the PKDGeometry node
-      // as a shared data pointer.
+      // Map the file (a container), or the binary file next to it (an
+      // xml .pkd), and hand sections of it off to the PKDGeometry node
+      // as shared data pointers.
       // We then also need to make a transfer function in the case that the
       // data has attributes
-      auto doc = xml::readXML(fileName);
-      const std::string binFileName = fileName.str() + "bin";
-      unsigned char *binBasePtr = const_cast<unsigned char*>(mapFile(binFileName));
+      const bool container = pkd::isContainer(fileName.str());
+      const std::string binFileName = container ? fileName.str() : fileName.str() + "bin";
+      // with huge pages or NUMA interleaving asked for (see
+      // PKDMemory.h), the file gets read into memory placed
+      // accordingly; otherwise it just gets mapped
+      const pkd::LoadOptions loadOptions = pkd::LoadOptions::fromEnvironment();
+      unsigned char *binBasePtr = NULL;
+      size_t binSize = 0;
+      if (loadOptions.any()) {
+        binBasePtr = pkd::loadFile(binFileName,loadOptions,binSize);
+        std::cout << "Loaded " << binFileName << ": "
+                  << pkd::placementReport(binBasePtr,binSize) << "\n";
+      } else {
+        binBasePtr = const_cast<unsigned char*>(mapFile(binFileName));
+        if (container)
+          binSize = pkd::fileSizeOf(binFileName);
+      }
       if (!binBasePtr) {
         std::cout << "Failed to load corresponding pkdbin file for " << fileName.str() << "\n";
         throw std::runtime_error("Failed to load corresponding pkdbin file for "
                                   + fileName.str());
       }
-      auto geom = createNode(fileName.str(), "PKDGeometry")->nodeAs<PKDGeometry>();
 
-      const xml::Node &pkdNode = doc->child[0].child[0];
-      if (pkdNode.name != "PKDGeometry") {
-        std::cout << "failed to find PKDGeometry child node\n";
-        throw std::runtime_error("failed to find PKDGeometry child node");
-      }
-      for (const xml::Node &e : pkdNode.child) {
-        if (e.name == "position") {
-          const std::string format = e.getProp("format");
-          const size_t offset = std::stoull(e.getProp("ofs"));
-          const size_t count = std::stoull(e.getProp("count"));
-          if (format == "vec3f" || format == "float3") {
-            std::cout << "Loading uncompressed PKD\n";
-            auto posData = std::make_shared<DataArray3f>(reinterpret_cast<vec3f*>(binBasePtr + offset), count, false);
-            posData->setName("position");
-            geom->add(posData);
-          } else if (format == "uint64") {
-            std::cout << "Loading quantized PKD\n";
-            auto posData = std::make_shared<DataArrayT<uint64_t, OSP_ULONG>>(
-                reinterpret_cast<uint64_t*>(binBasePtr + offset), count, false);
-            posData->setName("position");
-            geom->add(posData);
-          }
-        } else if (e.name == "radius") {
-          geom->createChild("radius", "float", std::stof(e.content));
-        } else if (e.name == "attribute") {
-          std::cout << "Got attribute: " << e.getProp("name") << "\n";
-          const std::string format = e.getProp("format");
-          const size_t offset = std::stoull(e.getProp("ofs"));
-          const size_t count = std::stoull(e.getProp("count"));
-          if (format == "float") {
-            auto attribData = std::make_shared<DataArray1f>(reinterpret_cast<float*>(binBasePtr + offset), count, false);
-            attribData->setName("attribute");
-            geom->add(attribData);
-          } else {
-            std::cout << "Unsupported attribute type: " << format << "\n";
-          }
+      // the same sections either way; a container's section table is
+      // checked, its data only if OSPRAY_PKD_VERIFY is set
+      std::vector<pkd::Section> sections;
+      if (container) {
+        const char *verify = getenv("OSPRAY_PKD_VERIFY");
+        sections = pkd::readContainer(binBasePtr, binSize, verify && atoi(verify));
+      } else {
+        auto doc = xml::readXML(fileName);
+        const xml::Node &pkdNode = doc->child[0].child[0];
+        if (pkdNode.name != "PKDGeometry") {
+          std::cout << "failed to find PKDGeometry child node\n";
+          throw std::runtime_error("failed to find PKDGeometry child node");
         }
+        sections = pkd::sectionsOfXML(pkdNode, binBasePtr);
       }
-      if (geom->hasChild("attribute")) {
+      auto geom = createNode(fileName.str(), "PKDGeometry")->nodeAs<PKDGeometry>();
+
+      // attributes become "attribute.<i>", in file order; their range
+      // trees (if the file has them) "attributeRangeTree.<i>"
+      PKDParamSink sink(geom);
+      pkd::paramsOfSections(sections, sink);
+      if (sink.numAttributes > 0) {
+        // switches color mapping and culling between the attributes
+        geom->createChild("activeAttribute", "int", 0);
         auto tfn = createNode("transferFunction", "TransferFunction")->nodeAs<TransferFunction>();
         // Start with everything opaque in the data (show all particles)
         tfn->child("opacityControlPoints").nodeAs<DataVector2f>()->v[0].y = 1;
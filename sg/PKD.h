@@ -27,9 +27,6 @@ namespace ospray {
       box3f bounds() const override;
 
       void postCommit(RenderContext &ctx) override;
-
-    private:
-      vec3f decodeParticle(uint64_t i) const;
     };
     
   }